@@ -0,0 +1,63 @@
+#ifndef BLUR_KERNELS_H
+#define BLUR_KERNELS_H
+
+/*
+ * Exact division by a constant: t / n == (t * mul) >> shift for every
+ * t in [0, max_sum], so the kernels never divide.
+ */
+typedef struct blur_divisor {
+    unsigned int mul;
+    int shift;
+} blur_divisor;
+
+/*
+ * Find the smallest shift whose rounding error provably stays below one
+ * for every t in [0, max_sum] (make check tries them all). Returns 0 if
+ * there is none (huge radii only).
+ */
+int blur_divisor_init(blur_divisor* div, int n, int max_sum);
+
+/* Radii that get a kernel compiled for them specifically */
+#define BLUR_KERNELS_MAX_RADIUS 8
+
+/*
+ * Pixels are bytes and column sums are 16-bit: 2*size+1 pixels of at
+ * most 255 have to fit, which holds up to this radius.
+ */
+#define BLUR_KERNELS_MAX_SIZE 128
+
+/*
+ * row[k] = box sum of colsum around k / (2*size+1)^2 for k in
+ * [size, width - size), div being that divisor. *moved is set if the row
+ * differs from old, and the return value is 1 if no pixel moved by more
+ * than threshold. scratch holds width + 1 32-bit sums.
+ */
+typedef int (*blur_row_fn)(const unsigned short* colsum, const unsigned char* old,
+    unsigned char* row, unsigned int* scratch, int size, const blur_divisor* div,
+    int threshold, int width, int* moved);
+
+/*
+ * Inner loops of the box blur, in one flavour per instruction set.
+ *
+ * colsum_add:             colsum[k] += in[k]
+ * colsum_slide:           colsum[k] += in[k] - out[k]
+ * row_from_colsum:        blur_row_fn for any radius
+ * row_from_colsum_radius: blur_row_fn for radius 1..BLUR_KERNELS_MAX_RADIUS
+ *                         only, indexed by radius (entry 0 is unused)
+ */
+typedef struct blur_kernels {
+    const char* name;
+    void (*colsum_add)(unsigned short* colsum, const unsigned char* in, int width);
+    void (*colsum_slide)(unsigned short* colsum, const unsigned char* in,
+        const unsigned char* out, int width);
+    blur_row_fn row_from_colsum;
+    blur_row_fn row_from_colsum_radius[BLUR_KERNELS_MAX_RADIUS + 1];
+} blur_kernels;
+
+/* Best kernels for the running CPU, chosen with CPUID on first call */
+const blur_kernels* blur_kernels_select(void);
+
+/* Row kernel for a radius: the specialised one if any, else the generic */
+blur_row_fn blur_kernels_row(const blur_kernels* kernels, int size);
+
+#endif // BLUR_KERNELS_H
@@ -1,8 +1,10 @@
 #ifndef CUDA_FUNCTIONS_H
 #define CUDA_FUNCTIONS_H
 
-void apply_blur_filter_cuda(int* image, int threshold, int size, int width, int height);
-void apply_sobel_filter_cuda(int* image, int width, int height);
+/* image is pixel (0, 0) of a frame whose rows are stride bytes apart */
+void apply_blur_filter_cuda(unsigned char* image, int threshold, int size, int width, int height,
+    int stride);
+void apply_sobel_filter_cuda(unsigned char* image, int width, int height, int stride);
 int is_cuda_available();
 
 #endif // CUDA_FUNCTIONS_H
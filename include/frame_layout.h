@@ -0,0 +1,47 @@
+#ifndef FRAME_LAYOUT_H
+#define FRAME_LAYOUT_H
+
+/*
+ * How a gray frame sits in memory. Rows are stride bytes apart and every
+ * row starts on a FRAME_ALIGN boundary. Around the frame are halo rows
+ * and columns holding copies of the nearest edge pixel, and the rest of
+ * the padding is zero. Kernels may read [-pad, cols + pad) of any row
+ * (and the rows next to it), so they can run whole aligned vectors over
+ * a row without checking where it ends.
+ *
+ *   pixel (j, k) is frame[origin + j * stride + k]
+ */
+#define FRAME_ALIGN 64
+
+/* Default halo width in pixels. The Sobel needs at least 1. */
+#ifndef FRAME_HALO
+#define FRAME_HALO 1
+#endif
+
+typedef struct frame_layout {
+    int width;
+    int height;
+    int halo;                /* Halo rows and columns on each side */
+    int pad;                 /* Bytes before and after each row: halo rounded up */
+    int cols;                /* width rounded up to FRAME_ALIGN */
+    int stride;              /* pad + cols + pad */
+    long long int origin;    /* Offset of pixel (0, 0) */
+    long long int bytes;     /* Whole frame, halo rows included */
+} frame_layout;
+
+/* Layout of a width x height frame with a halo of halo pixels (at least 1) */
+void frame_layout_init(frame_layout* layout, int width, int height, int halo);
+
+/* Fill the halo and the padding of frame once its pixels are in place */
+void frame_fill_halo(unsigned char* frame, const frame_layout* layout);
+
+/* Copy the pixels of frame to pixels, rows of width bytes one after the other */
+void frame_pack(const unsigned char* frame, const frame_layout* layout, unsigned char* pixels);
+
+/* Lay out packed pixels (as frame_pack gives them) in frame, halo included */
+void frame_unpack(const unsigned char* pixels, const frame_layout* layout, unsigned char* frame);
+
+/* Buffer of bytes aligned on FRAME_ALIGN, released with free() */
+unsigned char* frame_alloc(long long int bytes);
+
+#endif // FRAME_LAYOUT_H
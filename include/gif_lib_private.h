@@ -16,6 +16,7 @@ gif_lib_private.h - internal giflib routines and structures
 
 #define LZ_MAX_CODE         4095    /* Biggest code possible in 12 bits. */
 #define LZ_BITS             12
+#define LZ_DICT_SIZE(Bits)  ((LZ_MAX_CODE + 1) << (Bits))    /* Pixel x code. */
 
 #define FLUSH_OUTPUT        4096    /* Impossible code, to signal flush. */
 #define FIRST_CODE          4097    /* Impossible code, to signal first. */
@@ -50,7 +51,10 @@ typedef struct GifFilePrivateType {
     GifByteType Stack[LZ_MAX_CODE]; /* Decoded pixels are stacked here. */
     GifByteType Suffix[LZ_MAX_CODE + 1];    /* So we can trace the codes. */
     GifPrefixType Prefix[LZ_MAX_CODE + 1];
-    GifHashTableType *HashTable;
+    uint16_t *Children; /* Encoder: code of string Code + Pixel at
+                           (Pixel << LZ_BITS) + Code, to be checked
+                           against Prefix and Suffix: stale after a clear. */
+    int ChildrenBits;   /* Largest BitsPerPixel Children has room for. */
     bool gif89;
 } GifFilePrivateType;
 
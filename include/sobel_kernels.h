@@ -0,0 +1,32 @@
+#ifndef SOBEL_KERNELS_H
+#define SOBEL_KERNELS_H
+
+/*
+ * sqrt(dx^2 + dy^2) / 4 > 50 is dx^2 + dy^2 > 200^2: with pixels in
+ * [0, 255] both sides are exact integers, so no square root is needed.
+ */
+#define SOBEL_THRESHOLD_SQ 40000
+
+/*
+ * out[k] = 255 if the Sobel gradient at column k of row is above the
+ * threshold, 0 otherwise, for k in [1, width - 1). above and below are
+ * the rows around row and out must not overlap them.
+ *
+ * Rows are laid out as in frame_layout.h and out is aligned on
+ * FRAME_ALIGN: the vector kernels fill out in whole aligned blocks up to
+ * width rounded up to FRAME_ALIGN, reading one pixel past each end of
+ * the rows, then put columns 0 and width - 1 back from row.
+ */
+typedef void (*sobel_row_fn)(const unsigned char* above, const unsigned char* row,
+    const unsigned char* below, unsigned char* out, int width);
+
+/* Sobel inner loop, in one flavour per instruction set */
+typedef struct sobel_kernels {
+    const char* name;
+    sobel_row_fn row;
+} sobel_kernels;
+
+/* Best kernel for the running CPU, chosen with CPUID on first call */
+const sobel_kernels* sobel_kernels_select(void);
+
+#endif // SOBEL_KERNELS_H
@@ -0,0 +1,501 @@
+/*
+ * INF560
+ *
+ * Box blur inner loops: a scalar version and SSE4.2 / AVX2 / AVX-512
+ * versions picked at run time, so one binary runs everywhere.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "blur_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLUR_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+int blur_divisor_init(blur_divisor* div, int n, int max_sum)
+{
+    int shift;
+
+    for (shift = 0; shift < 64; shift++) {
+        unsigned long long mul = ((1ULL << shift) + n - 1) / n;
+        unsigned long long err;
+
+        if (mul > 0xFFFFFFFFULL) {
+            break;
+        }
+
+        /*
+         * With t = q*n + r, t*mul / 2^shift = t/n + t*err / (n * 2^shift),
+         * which stays below q + 1 as long as t*err < 2^shift.
+         */
+        err = mul * n - (1ULL << shift);
+        if ((unsigned long long)max_sum * err < (1ULL << shift)) {
+            div->mul = (unsigned int)mul;
+            div->shift = shift;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int divide_scalar(unsigned int t, const blur_divisor* div)
+{
+    return (int)(((unsigned long long)t * div->mul) >> div->shift);
+}
+
+static void colsum_add_scalar(unsigned short* colsum, const unsigned char* in, int width)
+{
+    int k;
+
+    for (k = 0; k < width; k++) {
+        colsum[k] += in[k];
+    }
+}
+
+static void colsum_slide_scalar(unsigned short* colsum, const unsigned char* in,
+    const unsigned char* out, int width)
+{
+    int k;
+
+    for (k = 0; k < width; k++) {
+        colsum[k] += in[k] - out[k];
+    }
+}
+
+/*
+ * Every row kernel is written once as an always-inline body taking the
+ * radius as an argument. BLUR_ROW_KERNELS then stamps out a generic entry
+ * point plus one entry point per radius 1..BLUR_KERNELS_MAX_RADIUS in
+ * which the radius is a literal, so the compiler can fold the offsets and
+ * unroll the window set-up.
+ */
+#define BLUR_ROW_KERNEL(isa, target, suffix, radius) \
+    target static int row_from_colsum_##isa##suffix(const unsigned short* colsum, \
+        const unsigned char* old, unsigned char* row, unsigned int* scratch, int size, \
+        const blur_divisor* div, int threshold, int width, int* moved) \
+    { \
+        (void)size; \
+        return row_from_colsum_##isa##_body(colsum, old, row, scratch, radius, div, \
+            threshold, width, moved); \
+    }
+
+#define BLUR_ROW_KERNELS(isa, target) \
+    BLUR_ROW_KERNEL(isa, target, , size) \
+    BLUR_ROW_KERNEL(isa, target, _r1, 1) \
+    BLUR_ROW_KERNEL(isa, target, _r2, 2) \
+    BLUR_ROW_KERNEL(isa, target, _r3, 3) \
+    BLUR_ROW_KERNEL(isa, target, _r4, 4) \
+    BLUR_ROW_KERNEL(isa, target, _r5, 5) \
+    BLUR_ROW_KERNEL(isa, target, _r6, 6) \
+    BLUR_ROW_KERNEL(isa, target, _r7, 7) \
+    BLUR_ROW_KERNEL(isa, target, _r8, 8)
+
+#define BLUR_ROW_RADIUS_TABLE(isa) { \
+    NULL, \
+    row_from_colsum_##isa##_r1, \
+    row_from_colsum_##isa##_r2, \
+    row_from_colsum_##isa##_r3, \
+    row_from_colsum_##isa##_r4, \
+    row_from_colsum_##isa##_r5, \
+    row_from_colsum_##isa##_r6, \
+    row_from_colsum_##isa##_r7, \
+    row_from_colsum_##isa##_r8 \
+}
+
+static inline __attribute__((always_inline))
+int row_from_colsum_scalar_body(const unsigned short* colsum, const unsigned char* old,
+    unsigned char* row, unsigned int* scratch, int size, const blur_divisor* div, int threshold,
+    int width, int* moved)
+{
+    int k;
+    unsigned int t = 0;
+    int diffs = 0;
+    int end = 1;
+
+    (void)scratch;
+    for (k = 0; k < 2 * size; k++) {
+        t += colsum[k];
+    }
+    for (k = size; k < width - size; k++) {
+        int diff;
+
+        t += colsum[k + size];
+        row[k] = divide_scalar(t, div);
+        t -= colsum[k - size];
+
+        diff = row[k] - old[k];
+        if (diff > threshold || -diff > threshold) {
+            end = 0;
+        }
+        diffs |= diff;
+    }
+    *moved = diffs != 0;
+
+    return end;
+}
+
+BLUR_ROW_KERNELS(scalar, )
+
+static const blur_kernels kernels_scalar = {
+    "scalar",
+    colsum_add_scalar,
+    colsum_slide_scalar,
+    row_from_colsum_scalar,
+    BLUR_ROW_RADIUS_TABLE(scalar)
+};
+
+#ifdef BLUR_KERNELS_X86
+
+/*
+ * The vector row kernels cannot slide a running sum along the row, so they
+ * first turn colsum into a prefix sum (scratch[k] = colsum[0] + ... +
+ * colsum[k-1]) and take the box sum of column k as a difference of two
+ * prefixes. Unsigned wrap-around keeps the differences exact.
+ *
+ * The division is the multiply-shift of blur_divisor, done in 64-bit
+ * lanes: even and odd 32-bit lanes are multiplied separately and the two
+ * quotients are blended back together.
+ */
+static void prefix_sum(const unsigned short* colsum, unsigned int* scratch, int width)
+{
+    unsigned int acc = 0;
+    int k;
+
+    scratch[0] = 0;
+    for (k = 0; k < width; k++) {
+        acc += colsum[k];
+        scratch[k + 1] = acc;
+    }
+}
+
+/* Scalar tail shared by the vector kernels, for columns [k, width - size) */
+static int row_tail(const unsigned int* scratch, const unsigned char* old, unsigned char* row,
+    int k, int size, const blur_divisor* div, int threshold, int width, int* diffs)
+{
+    int end = 1;
+
+    for (; k < width - size; k++) {
+        unsigned int t = scratch[k + size + 1] - scratch[k - size];
+        int diff;
+
+        row[k] = divide_scalar(t, div);
+        diff = row[k] - old[k];
+        if (diff > threshold || -diff > threshold) {
+            end = 0;
+        }
+        *diffs |= diff;
+    }
+    return end;
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i divide_sse42(__m128i t, __m128i mul, __m128i shift)
+{
+    __m128i even = _mm_srl_epi64(_mm_mul_epu32(t, mul), shift);
+    __m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(t, 32), mul), shift);
+
+    return _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xCC);
+}
+
+__attribute__((target("sse4.2")))
+static void colsum_add_sse42(unsigned short* colsum, const unsigned char* in, int width)
+{
+    int k;
+
+    for (k = 0; k + 8 <= width; k += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(colsum + k));
+        c = _mm_add_epi16(c, _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(in + k))));
+        _mm_storeu_si128((__m128i*)(colsum + k), c);
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k];
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void colsum_slide_sse42(unsigned short* colsum, const unsigned char* in,
+    const unsigned char* out, int width)
+{
+    int k;
+
+    for (k = 0; k + 8 <= width; k += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(colsum + k));
+        __m128i d = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(in + k))),
+            _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(out + k))));
+        _mm_storeu_si128((__m128i*)(colsum + k), _mm_add_epi16(c, d));
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k] - out[k];
+    }
+}
+
+/* Four pixels in and out of the low lane of a register */
+__attribute__((target("sse4.2")))
+static inline __m128i load4_sse42(const unsigned char* p)
+{
+    int four;
+
+    memcpy(&four, p, sizeof(four));
+    return _mm_cvtsi32_si128(four);
+}
+
+__attribute__((target("sse4.2")))
+static inline void store4_sse42(unsigned char* p, __m128i v)
+{
+    int four = _mm_cvtsi128_si32(v);
+
+    memcpy(p, &four, sizeof(four));
+}
+
+static inline __attribute__((always_inline, target("sse4.2")))
+int row_from_colsum_sse42_body(const unsigned short* colsum, const unsigned char* old,
+    unsigned char* row, unsigned int* scratch, int size, const blur_divisor* div, int threshold,
+    int width, int* moved)
+{
+    int k = size;
+    int diffs = 0;
+    int end;
+    __m128i mul, shift, thr, bad, any;
+
+    prefix_sum(colsum, scratch, width);
+    mul = _mm_set1_epi32((int)div->mul);
+    shift = _mm_cvtsi32_si128(div->shift);
+    thr = _mm_set1_epi32(threshold);
+    bad = _mm_setzero_si128();
+    any = _mm_setzero_si128();
+    for (; k + 4 <= width - size; k += 4) {
+        __m128i t = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(scratch + k + size + 1)),
+            _mm_loadu_si128((const __m128i*)(scratch + k - size)));
+        __m128i q = divide_sse42(t, mul, shift);
+        __m128i diff = _mm_sub_epi32(q, _mm_cvtepu8_epi32(load4_sse42(old + k)));
+
+        store4_sse42(row + k, _mm_packus_epi16(_mm_packus_epi32(q, q), q));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi32(_mm_abs_epi32(diff), thr));
+        any = _mm_or_si128(any, diff);
+    }
+    end = row_tail(scratch, old, row, k, size, div, threshold, width, &diffs);
+    *moved = diffs != 0 || !_mm_testz_si128(any, any);
+
+    return end && _mm_testz_si128(bad, bad);
+}
+
+BLUR_ROW_KERNELS(sse42, __attribute__((target("sse4.2"))))
+
+static const blur_kernels kernels_sse42 = {
+    "sse4.2",
+    colsum_add_sse42,
+    colsum_slide_sse42,
+    row_from_colsum_sse42,
+    BLUR_ROW_RADIUS_TABLE(sse42)
+};
+
+__attribute__((target("avx2")))
+static inline __m256i divide_avx2(__m256i t, __m256i mul, __m128i shift)
+{
+    __m256i even = _mm256_srl_epi64(_mm256_mul_epu32(t, mul), shift);
+    __m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(t, 32), mul), shift);
+
+    return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+__attribute__((target("avx2")))
+static void colsum_add_avx2(unsigned short* colsum, const unsigned char* in, int width)
+{
+    int k;
+
+    for (k = 0; k + 16 <= width; k += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(colsum + k));
+        c = _mm256_add_epi16(c, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(in + k))));
+        _mm256_storeu_si256((__m256i*)(colsum + k), c);
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k];
+    }
+}
+
+__attribute__((target("avx2")))
+static void colsum_slide_avx2(unsigned short* colsum, const unsigned char* in,
+    const unsigned char* out, int width)
+{
+    int k;
+
+    for (k = 0; k + 16 <= width; k += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(colsum + k));
+        __m256i d = _mm256_sub_epi16(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(in + k))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(out + k))));
+        _mm256_storeu_si256((__m256i*)(colsum + k), _mm256_add_epi16(c, d));
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k] - out[k];
+    }
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+int row_from_colsum_avx2_body(const unsigned short* colsum, const unsigned char* old,
+    unsigned char* row, unsigned int* scratch, int size, const blur_divisor* div, int threshold,
+    int width, int* moved)
+{
+    int k = size;
+    int diffs = 0;
+    int end;
+    __m128i shift;
+    __m256i mul, thr, bad, any;
+
+    prefix_sum(colsum, scratch, width);
+    mul = _mm256_set1_epi32((int)div->mul);
+    shift = _mm_cvtsi32_si128(div->shift);
+    thr = _mm256_set1_epi32(threshold);
+    bad = _mm256_setzero_si256();
+    any = _mm256_setzero_si256();
+    for (; k + 8 <= width - size; k += 8) {
+        __m256i t = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(scratch + k + size + 1)),
+            _mm256_loadu_si256((const __m256i*)(scratch + k - size)));
+        __m256i q = divide_avx2(t, mul, shift);
+        __m256i diff = _mm256_sub_epi32(q,
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(old + k))));
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+
+        _mm_storel_epi64((__m128i*)(row + k), _mm_packus_epi16(words, words));
+        bad = _mm256_or_si256(bad, _mm256_cmpgt_epi32(_mm256_abs_epi32(diff), thr));
+        any = _mm256_or_si256(any, diff);
+    }
+    end = row_tail(scratch, old, row, k, size, div, threshold, width, &diffs);
+    *moved = diffs != 0 || !_mm256_testz_si256(any, any);
+
+    return end && _mm256_testz_si256(bad, bad);
+}
+
+BLUR_ROW_KERNELS(avx2, __attribute__((target("avx2"))))
+
+static const blur_kernels kernels_avx2 = {
+    "avx2",
+    colsum_add_avx2,
+    colsum_slide_avx2,
+    row_from_colsum_avx2,
+    BLUR_ROW_RADIUS_TABLE(avx2)
+};
+
+__attribute__((target("avx512f")))
+static inline __m512i divide_avx512(__m512i t, __m512i mul, __m128i shift)
+{
+    __m512i even = _mm512_srl_epi64(_mm512_mul_epu32(t, mul), shift);
+    __m512i odd = _mm512_srl_epi64(_mm512_mul_epu32(_mm512_srli_epi64(t, 32), mul), shift);
+
+    return _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void colsum_add_avx512(unsigned short* colsum, const unsigned char* in, int width)
+{
+    int k;
+
+    for (k = 0; k + 32 <= width; k += 32) {
+        __m512i c = _mm512_loadu_si512(colsum + k);
+        c = _mm512_add_epi16(c, _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(in + k))));
+        _mm512_storeu_si512(colsum + k, c);
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k];
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void colsum_slide_avx512(unsigned short* colsum, const unsigned char* in,
+    const unsigned char* out, int width)
+{
+    int k;
+
+    for (k = 0; k + 32 <= width; k += 32) {
+        __m512i c = _mm512_loadu_si512(colsum + k);
+        __m512i d = _mm512_sub_epi16(
+            _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(in + k))),
+            _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(out + k))));
+        _mm512_storeu_si512(colsum + k, _mm512_add_epi16(c, d));
+    }
+    for (; k < width; k++) {
+        colsum[k] += in[k] - out[k];
+    }
+}
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw")))
+int row_from_colsum_avx512_body(const unsigned short* colsum, const unsigned char* old,
+    unsigned char* row, unsigned int* scratch, int size, const blur_divisor* div, int threshold,
+    int width, int* moved)
+{
+    int k = size;
+    int diffs = 0;
+    int end;
+    __m128i shift;
+    __m512i mul, thr;
+    __mmask16 bad = 0;
+    __mmask16 any = 0;
+
+    prefix_sum(colsum, scratch, width);
+    mul = _mm512_set1_epi32((int)div->mul);
+    shift = _mm_cvtsi32_si128(div->shift);
+    thr = _mm512_set1_epi32(threshold);
+    for (; k + 16 <= width - size; k += 16) {
+        __m512i t = _mm512_sub_epi32(_mm512_loadu_si512(scratch + k + size + 1),
+            _mm512_loadu_si512(scratch + k - size));
+        __m512i q = divide_avx512(t, mul, shift);
+        __m512i diff = _mm512_sub_epi32(q,
+            _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(old + k))));
+
+        _mm_storeu_si128((__m128i*)(row + k), _mm512_cvtepi32_epi8(q));
+        bad |= _mm512_cmpgt_epi32_mask(_mm512_abs_epi32(diff), thr);
+        any |= _mm512_test_epi32_mask(diff, diff);
+    }
+    end = row_tail(scratch, old, row, k, size, div, threshold, width, &diffs);
+    *moved = diffs != 0 || any != 0;
+
+    return end && bad == 0;
+}
+
+BLUR_ROW_KERNELS(avx512, __attribute__((target("avx512f,avx512bw"))))
+
+static const blur_kernels kernels_avx512 = {
+    "avx512",
+    colsum_add_avx512,
+    colsum_slide_avx512,
+    row_from_colsum_avx512,
+    BLUR_ROW_RADIUS_TABLE(avx512)
+};
+
+#endif /* BLUR_KERNELS_X86 */
+
+blur_row_fn blur_kernels_row(const blur_kernels* kernels, int size)
+{
+    if (size >= 1 && size <= BLUR_KERNELS_MAX_RADIUS) {
+        return kernels->row_from_colsum_radius[size];
+    }
+    return kernels->row_from_colsum;
+}
+
+const blur_kernels* blur_kernels_select(void)
+{
+    static const blur_kernels* selected = NULL;
+
+    if (selected != NULL) {
+        return selected;
+    }
+
+    selected = &kernels_scalar;
+#ifdef BLUR_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        selected = &kernels_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        selected = &kernels_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.2")) {
+        selected = &kernels_sse42;
+    }
+#endif
+
+    return selected;
+}
@@ -2,10 +2,12 @@
 #include <cuda_runtime.h>
 #include <cstdio>
 
+#include "sobel_kernels.h"
 // #include "cuda_functions.h"
 
+/* Offset of pixel (l, c) in rows of nb_c, computed in 64 bits */
 #define CONV(l, c, nb_c) \
-(l) * (nb_c) + (c)
+((size_t)(l) * (nb_c) + (c))
 
 extern "C" int is_cuda_available() {
     int deviceCount;
@@ -37,12 +39,12 @@ extern "C" void test2(int* image) {
     printf("after %d\n", image[0]);
 }
 
-__global__ void apply_blur_filter_kernel(int* image, int* new_image, int *end, int size, int* threshold, int width, int height) {
+__global__ void apply_blur_filter_kernel(unsigned char* image, unsigned char* new_image, int *end, int size, int* threshold, int width, int height, int stride) {
     int j = threadIdx.y + blockDim.y * blockIdx.y;
     int i = threadIdx.x + blockDim.x * blockIdx.x;
     
     if (j >= 0 && j < height && i >= 0 && i < width) {
-        new_image[j * width + i] = image[j * width + i];
+        new_image[CONV(j, i, stride)] = image[CONV(j, i, stride)];
         if (j >= size && j < height / 10 - size) {
             if (i >= size && i < width - size) {
                 int stencil_j, stencil_k;
@@ -50,10 +52,10 @@ __global__ void apply_blur_filter_kernel(int* image, int* new_image, int *end, i
 
                 for (stencil_j = -size; stencil_j <= size; stencil_j++) {
                     for (stencil_k = -size; stencil_k <= size; stencil_k++) {
-                        t += image[(j + stencil_j) * width + (i + stencil_k)];
+                        t += image[CONV(j + stencil_j, i + stencil_k, stride)];
                     }
                 }
-                new_image[j * width + i] = t / ((2 * size + 1) * (2 * size + 1));
+                new_image[CONV(j, i, stride)] = t / ((2 * size + 1) * (2 * size + 1));
             }
         }
 
@@ -64,38 +66,39 @@ __global__ void apply_blur_filter_kernel(int* image, int* new_image, int *end, i
 
                 for (stencil_j = -size; stencil_j <= size; stencil_j++) {
                     for (stencil_k = -size; stencil_k <= size; stencil_k++) {
-                        t += image[(j + stencil_j) * width + (i + stencil_k)];
+                        t += image[CONV(j + stencil_j, i + stencil_k, stride)];
                     }
                 }
 
-                new_image[j * width + i] = t / ((2 * size + 1) * (2 * size + 1));
+                new_image[CONV(j, i, stride)] = t / ((2 * size + 1) * (2 * size + 1));
             }
         }
 
         __syncthreads();
 
         if (j > 0 && j < height - 1 && i > 0 && i < width - 1) {
-            float diff = new_image[j * width + i] - image[j * width + i];
+            float diff = new_image[CONV(j, i, stride)] - image[CONV(j, i, stride)];
             if (diff > *threshold || -diff > *threshold) {
                 atomicAnd(end, 0);
             }
-            image[j * width + i] = new_image[j * width + i];
+            image[CONV(j, i, stride)] = new_image[CONV(j, i, stride)];
         }
     }
 }
 
-extern "C" void apply_blur_filter_cuda(int* image, int threshold, int size, int width, int height) {
-    int* d_image;
-    int* d_new_image;
+extern "C" void apply_blur_filter_cuda(unsigned char* image, int threshold, int size, int width, int height, int stride) {
+    unsigned char* d_image;
+    unsigned char* d_new_image;
     int* d_threshold;
     int* d_end;
     int end = 0;
+    size_t bytes = (size_t)(height - 1) * stride + width;
 
-    cudaMalloc(&d_image, width * height * sizeof(int));
-    cudaMalloc(&d_new_image, width * height * sizeof(int));
+    cudaMalloc(&d_image, bytes);
+    cudaMalloc(&d_new_image, bytes);
     cudaMalloc(&d_threshold, sizeof(int));
     cudaMalloc(&d_end, sizeof(int));
-    cudaMemcpy(d_image, image, width * height * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(d_image, image, bytes, cudaMemcpyHostToDevice);
     cudaMemcpy(d_threshold, &threshold, sizeof(int), cudaMemcpyHostToDevice);
     dim3 block_size(32, 32);
     dim3 grid_size((width + block_size.x - 1) / block_size.x + 1, (height + block_size.y - 1) / block_size.y + 1, 1);
@@ -103,9 +106,9 @@ extern "C" void apply_blur_filter_cuda(int* image, int threshold, int size, int
     do {
         end = 1;
         cudaMemcpy(d_end, &end, sizeof(int), cudaMemcpyHostToDevice);
-        apply_blur_filter_kernel<<<grid_size, block_size>>>(d_image, d_new_image, d_end, size, d_threshold, width, height);
+        apply_blur_filter_kernel<<<grid_size, block_size>>>(d_image, d_new_image, d_end, size, d_threshold, width, height, stride);
 
-        cudaMemcpy(image, d_image, width * height * sizeof(int), cudaMemcpyDeviceToHost);
+        cudaMemcpy(image, d_image, bytes, cudaMemcpyDeviceToHost);
         cudaMemcpy(&end, d_end, sizeof(int), cudaMemcpyDeviceToHost);
         cudaMemcpy(&threshold, d_threshold, sizeof(int), cudaMemcpyDeviceToHost);
 
@@ -118,46 +121,49 @@ extern "C" void apply_blur_filter_cuda(int* image, int threshold, int size, int
 
 
 
-__global__ void sobel_filter_kernel(int* image, int* sobel, int width, int height) {
+__global__ void sobel_filter_kernel(const unsigned char* image, unsigned char* sobel, int width, int height, int stride) {
     int j = blockIdx.y * blockDim.y + threadIdx.y;
     int k = blockIdx.x * blockDim.x + threadIdx.x;
     if (j > 0 && j < height - 1 && k > 0 && k < width - 1) {
-        int pixel_no = image[CONV(j - 1, k - 1, width)];
-        int pixel_n = image[CONV(j - 1, k, width)];
-        int pixel_ne = image[CONV(j - 1, k + 1, width)];
-        int pixel_so = image[CONV(j + 1, k - 1, width)];
-        int pixel_s = image[CONV(j + 1, k, width)];
-        int pixel_se = image[CONV(j + 1, k + 1, width)];
-        int pixel_o = image[CONV(j, k - 1, width)];
-        int pixel_e = image[CONV(j, k + 1, width)];
-        float deltaX = -pixel_no + pixel_ne - 2 * pixel_o + 2 * pixel_e - pixel_so + pixel_se;
-        float deltaY = pixel_se + 2 * pixel_s + pixel_so - pixel_ne - 2 * pixel_n - pixel_no;
-        float val = sqrtf(deltaX * deltaX + deltaY * deltaY) / 4;
-        if (val > 50) {
-            sobel[CONV(j, k, width)] = 255;
+        int pixel_no = image[CONV(j - 1, k - 1, stride)];
+        int pixel_n = image[CONV(j - 1, k, stride)];
+        int pixel_ne = image[CONV(j - 1, k + 1, stride)];
+        int pixel_so = image[CONV(j + 1, k - 1, stride)];
+        int pixel_s = image[CONV(j + 1, k, stride)];
+        int pixel_se = image[CONV(j + 1, k + 1, stride)];
+        int pixel_o = image[CONV(j, k - 1, stride)];
+        int pixel_e = image[CONV(j, k + 1, stride)];
+        int deltaX = -pixel_no + pixel_ne - 2 * pixel_o + 2 * pixel_e - pixel_so + pixel_se;
+        int deltaY = pixel_se + 2 * pixel_s + pixel_so - pixel_ne - 2 * pixel_n - pixel_no;
+        /* sqrt(deltaX^2 + deltaY^2) / 4 > 50, in integers */
+        if (deltaX * deltaX + deltaY * deltaY > SOBEL_THRESHOLD_SQ) {
+            sobel[CONV(j, k, stride)] = 255;
         }
         else {
-            sobel[CONV(j, k, width)] = 0;
+            sobel[CONV(j, k, stride)] = 0;
         }
     }
     else if(((j==0 || j == height-1) && (k>=0 && k<width)) || ((k==0 || k == width-1) && (j>=0 && j<height-1))) {
-        sobel[CONV(j, k, width)] = image[CONV(j, k, width)];
+        sobel[CONV(j, k, stride)] = image[CONV(j, k, stride)];
     }
 }
 
-extern "C" void apply_sobel_filter_cuda(int* image, int width, int height) {
-    int* d_image = NULL;
-    int* d_sobel = NULL;
-    cudaMalloc((void**)&d_image, width * height * sizeof(int));
-    cudaMalloc((void**)&d_sobel, width * height * sizeof(int));
-    cudaMemcpy(d_image, image, width * height * sizeof(int), cudaMemcpyHostToDevice);
+extern "C" void apply_sobel_filter_cuda(unsigned char* image, int width, int height, int stride) {
+    unsigned char* d_image = NULL;
+    unsigned char* d_sobel = NULL;
+    size_t bytes = (size_t)(height - 1) * stride + width;
+    cudaMalloc((void**)&d_image, bytes);
+    cudaMalloc((void**)&d_sobel, bytes);
+    cudaMemcpy(d_image, image, bytes, cudaMemcpyHostToDevice);
+    /* The padding between rows goes back unchanged */
+    cudaMemcpy(d_sobel, d_image, bytes, cudaMemcpyDeviceToDevice);
 
     dim3 block_size(32, 32);
     // gridSize must be s.t. we can fit the whole image
     dim3 grid_size((width + block_size.x - 1) / block_size.x + 1, (height + block_size.y - 1) / block_size.y + 1);
-    sobel_filter_kernel<<<grid_size, block_size>>>(d_image, d_sobel, width, height);
+    sobel_filter_kernel<<<grid_size, block_size>>>(d_image, d_sobel, width, height, stride);
     cudaFree(d_image);
-    cudaMemcpy(image, d_sobel, width*height * sizeof(int), cudaMemcpyDeviceToHost);
+    cudaMemcpy(image, d_sobel, bytes, cudaMemcpyDeviceToHost);
 
     cudaFree(d_sobel);
 }
@@ -9,6 +9,7 @@ two modules will be linked.  Preserve this property!
 *****************************************************************************/
 
 #include <unistd.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -104,13 +105,6 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
         return NULL;
     }
     /*@i1@*/memset(Private, '\0', sizeof(GifFilePrivateType));
-    if ((Private->HashTable = _InitHashTable()) == NULL) {
-        free(GifFile);
-        free(Private);
-        if (Error != NULL)
-	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
-        return NULL;
-    }
 
 #ifdef _WIN32
     _setmode(FileHandle, O_BINARY);    /* Make sure it is in binary mode. */
@@ -161,15 +155,6 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
 
     memset(Private, '\0', sizeof(GifFilePrivateType));
 
-    Private->HashTable = _InitHashTable();
-    if (Private->HashTable == NULL) {
-        free (GifFile);
-        free (Private);
-        if (Error != NULL)
-	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
-        return NULL;
-    }
-
     GifFile->Private = (void *)Private;
     Private->FileHandle = 0;
     Private->File = (FILE *) 0;
@@ -431,7 +416,8 @@ EGifPutImageDesc(GifFileType *GifFile,
     Private->PixelCount = (long)Width *(long)Height;
 
     /* Reset compress algorithm parameters. */
-    (void)EGifSetupCompress(GifFile);
+    if (EGifSetupCompress(GifFile) == GIF_ERROR)
+        return GIF_ERROR;
 
     return GIF_OK;
 }
@@ -790,8 +776,8 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
         GifFile->SColorMap = NULL;
     }
     if (Private) {
-        if (Private->HashTable) {
-            free((char *) Private->HashTable);
+        if (Private->Children) {
+            free((char *) Private->Children);
         }
 	free((char *) Private);
     }
@@ -846,6 +832,19 @@ EGifSetupCompress(GifFileType *GifFile)
     }
 
     Buf = BitsPerPixel = (BitsPerPixel < 2 ? 2 : BitsPerPixel);
+
+    /* The dictionary holds a slot for every code and pixel: */
+    if (Private->Children == NULL || Private->ChildrenBits < BitsPerPixel) {
+        free((char *) Private->Children);
+        Private->Children = (uint16_t *)calloc(LZ_DICT_SIZE(BitsPerPixel),
+                                               sizeof(uint16_t));
+        if (Private->Children == NULL) {
+            GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+            return GIF_ERROR;
+        }
+        Private->ChildrenBits = BitsPerPixel;
+    }
+
     InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
 
     Private->Buf[0] = 0;    /* Nothing was output yet. */
@@ -859,9 +858,8 @@ EGifSetupCompress(GifFileType *GifFile)
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
 
-   /* Clear hash table and send Clear to make sure the decoder do the same. */
-    _ClearHashTable(Private->HashTable);
-
+   /* Resetting RunningCode empties the dictionary; send Clear to make sure
+    * the decoder do the same. */
     if (EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
         GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
         return GIF_ERROR;
@@ -883,10 +881,10 @@ EGifCompressLine(GifFileType *GifFile,
     int i = 0, CrntCode, NewCode;
     unsigned long NewKey;
     GifPixelType Pixel;
-    GifHashTableType *HashTable;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
-
-    HashTable = Private->HashTable;
+    uint16_t *Children = Private->Children;
+    GifPrefixType *Prefix = Private->Prefix;
+    GifByteType *Suffix = Private->Suffix;
 
     if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
         CrntCode = Line[i++];
@@ -895,27 +893,32 @@ EGifCompressLine(GifFileType *GifFile,
 
     while (i < LineLen) {   /* Decode LineLen items. */
         Pixel = Line[i++];  /* Get next pixel from stream. */
-        /* Form a new unique key to search hash table for the code combines 
-         * CrntCode as Prefix string with Pixel as postfix char.
+        /* The string CrntCode + Pixel has its own slot in the dictionary.
+         * What the slot holds is its code only if that code is in use and
+         * stands for this very string: otherwise it was set before the
+         * last clear, and the string is new. Slots are grouped by Pixel,
+         * as runs of one pixel look up codes created close together.
          */
-        NewKey = (((uint32_t) CrntCode) << 8) + Pixel;
-        if ((NewCode = _ExistsHashTable(HashTable, NewKey)) >= 0) {
+        NewKey = (((uint32_t) Pixel) << LZ_BITS) + CrntCode;
+        NewCode = Children[NewKey];
+        if (NewCode > Private->EOFCode && NewCode < Private->RunningCode
+            && Prefix[NewCode] == (GifPrefixType) CrntCode
+            && Suffix[NewCode] == Pixel) {
             /* This Key is already there, or the string is old one, so
              * simple take new code as our CrntCode:
              */
             CrntCode = NewCode;
         } else {
-            /* Put it in hash table, output the prefix code, and make our
-             * CrntCode equal to Pixel.
+            /* Put it in the dictionary, output the prefix code, and make
+             * our CrntCode equal to Pixel.
              */
             if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
                 GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
                 return GIF_ERROR;
             }
-            CrntCode = Pixel;
 
-            /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
+            /* If however the dictionary is full, we send a clear first and
+             * start it over.
              */
             if (Private->RunningCode >= LZ_MAX_CODE) {
                 /* Time to do some clearance: */
@@ -927,11 +930,15 @@ EGifCompressLine(GifFileType *GifFile,
                 Private->RunningCode = Private->EOFCode + 1;
                 Private->RunningBits = Private->BitsPerPixel + 1;
                 Private->MaxCode1 = 1 << Private->RunningBits;
-                _ClearHashTable(HashTable);
             } else {
-                /* Put this unique key with its relative Code in hash table: */
-                _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
+                /* Put this unique string with its relative Code in the
+                 * dictionary: */
+                Children[NewKey] = Private->RunningCode;
+                Prefix[Private->RunningCode] = CrntCode;
+                Suffix[Private->RunningCode] = Pixel;
+                Private->RunningCode++;
             }
+            CrntCode = Pixel;
         }
 
     }
@@ -1075,10 +1082,65 @@ EGifWriteExtensions(GifFileType *GifFileOut,
     return (GIF_OK);
 }
 
+/******************************************************************************
+ Put the extensions, image descriptor and compressed pixels of one saved
+ image.
+******************************************************************************/
+static int
+EGifSpewImage(GifFileType *GifFileOut, SavedImage *sp)
+{
+    int SavedHeight = sp->ImageDesc.Height;
+    int SavedWidth = sp->ImageDesc.Width;
+    int j;
+
+    if (EGifWriteExtensions(GifFileOut, 
+			    sp->ExtensionBlocks,
+			    sp->ExtensionBlockCount) == GIF_ERROR)
+	return (GIF_ERROR);
+
+    if (EGifPutImageDesc(GifFileOut,
+                         sp->ImageDesc.Left,
+                         sp->ImageDesc.Top,
+                         SavedWidth,
+                         SavedHeight,
+                         sp->ImageDesc.Interlace,
+                         sp->ImageDesc.ColorMap) == GIF_ERROR)
+        return (GIF_ERROR);
+
+    if (sp->ImageDesc.Interlace) {
+	 /* 
+	  * The way an interlaced image should be written - 
+	  * offsets and jumps...
+	  */
+	int InterlacedOffset[] = { 0, 4, 2, 1 };
+	int InterlacedJumps[] = { 8, 8, 4, 2 };
+	int k;
+	/* Need to perform 4 passes on the images: */
+	for (k = 0; k < 4; k++)
+	    for (j = InterlacedOffset[k]; 
+		 j < SavedHeight;
+		 j += InterlacedJumps[k]) {
+		if (EGifPutLine(GifFileOut, 
+				sp->RasterBits + (long)j * SavedWidth, 
+				SavedWidth) == GIF_ERROR)
+		    return (GIF_ERROR);
+	    }
+    } else {
+	for (j = 0; j < SavedHeight; j++) {
+	    if (EGifPutLine(GifFileOut,
+			    sp->RasterBits + (long)j * SavedWidth,
+			    SavedWidth) == GIF_ERROR)
+		return (GIF_ERROR);
+	}
+    }
+
+    return (GIF_OK);
+}
+
 int
 EGifSpew(GifFileType *GifFileOut) 
 {
-    int i, j; 
+    int i; 
     
     if (EGifPutScreenDesc(GifFileOut,
                           GifFileOut->SWidth,
@@ -1091,53 +1153,159 @@ EGifSpew(GifFileType *GifFileOut)
 
     for (i = 0; i < GifFileOut->ImageCount; i++) {
         SavedImage *sp = &GifFileOut->SavedImages[i];
-        int SavedHeight = sp->ImageDesc.Height;
-        int SavedWidth = sp->ImageDesc.Width;
 
         /* this allows us to delete images by nuking their rasters */
         if (sp->RasterBits == NULL)
             continue;
 
-	if (EGifWriteExtensions(GifFileOut, 
-				sp->ExtensionBlocks,
-				sp->ExtensionBlockCount) == GIF_ERROR)
-	    return (GIF_ERROR);
-
-        if (EGifPutImageDesc(GifFileOut,
-                             sp->ImageDesc.Left,
-                             sp->ImageDesc.Top,
-                             SavedWidth,
-                             SavedHeight,
-                             sp->ImageDesc.Interlace,
-                             sp->ImageDesc.ColorMap) == GIF_ERROR)
+        if (EGifSpewImage(GifFileOut, sp) == GIF_ERROR)
             return (GIF_ERROR);
+    }
 
-	if (sp->ImageDesc.Interlace) {
-	     /* 
-	      * The way an interlaced image should be written - 
-	      * offsets and jumps...
-	      */
-	    int InterlacedOffset[] = { 0, 4, 2, 1 };
-	    int InterlacedJumps[] = { 8, 8, 4, 2 };
-	    int k;
-	    /* Need to perform 4 passes on the images: */
-	    for (k = 0; k < 4; k++)
-		for (j = InterlacedOffset[k]; 
-		     j < SavedHeight;
-		     j += InterlacedJumps[k]) {
-		    if (EGifPutLine(GifFileOut, 
-				    sp->RasterBits + j * SavedWidth, 
-				    SavedWidth)	== GIF_ERROR)
-			return (GIF_ERROR);
-		}
-	} else {
-	    for (j = 0; j < SavedHeight; j++) {
-		if (EGifPutLine(GifFileOut,
-				sp->RasterBits + j * SavedWidth,
-				SavedWidth) == GIF_ERROR)
-		    return (GIF_ERROR);
-	    }
-	}
+    if (EGifWriteExtensions(GifFileOut,
+			    GifFileOut->ExtensionBlocks,
+			    GifFileOut->ExtensionBlockCount) == GIF_ERROR)
+	return (GIF_ERROR);
+
+    if (EGifCloseFile(GifFileOut, NULL) == GIF_ERROR)
+        return (GIF_ERROR);
+
+    return (GIF_OK);
+}
+
+/******************************************************************************
+ Growing memory buffer that EGifSpewParallel compresses one image into.
+******************************************************************************/
+typedef struct GifMemoryOutput {
+    GifByteType *Bytes;
+    size_t Len, Size;
+    int Error;      /* Error of the image, 0 if none */
+} GifMemoryOutput;
+
+static int
+EGifMemoryWrite(GifFileType *GifFile, const GifByteType *Buf, int Len)
+{
+    GifMemoryOutput *Out = (GifMemoryOutput *)GifFile->UserData;
+
+    if (Out->Len + Len > Out->Size) {
+        size_t Size = Out->Size ? Out->Size : 4096;
+        GifByteType *Bytes;
+
+        while (Out->Len + Len > Size)
+            Size *= 2;
+        Bytes = (GifByteType *)realloc(Out->Bytes, Size);
+        if (Bytes == NULL)
+            return 0;
+        Out->Bytes = Bytes;
+        Out->Size = Size;
+    }
+    memcpy(Out->Bytes + Out->Len, Buf, Len);
+    Out->Len += Len;
+    return Len;
+}
+
+/******************************************************************************
+ GIF handle that compresses saved images of GifFileOut into memory, one
+ GifMemoryOutput (its UserData) at a time. It borrows the global color map
+ and is released by EGifCloseMemory, without writing a terminator.
+******************************************************************************/
+static GifFileType *
+EGifOpenMemory(const GifFileType *GifFileOut)
+{
+    GifFileType *GifFile;
+    GifFilePrivateType *Private;
+
+    GifFile = EGifOpen(NULL, EGifMemoryWrite, NULL);
+    if (GifFile == NULL)
+        return NULL;
+    Private = (GifFilePrivateType *)GifFile->Private;
+    Private->FileState |= FILE_STATE_SCREEN;
+    GifFile->SColorMap = GifFileOut->SColorMap;
+    return GifFile;
+}
+
+static void
+EGifCloseMemory(GifFileType *GifFile)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (GifFile->Image.ColorMap)
+        GifFreeMapObject(GifFile->Image.ColorMap);
+    free((char *) Private->Children);
+    free((char *) Private);
+    free(GifFile);
+}
+
+/******************************************************************************
+ Same output as EGifSpew, but the images are compressed in parallel, each
+ into a buffer of its own, and then written in order.
+******************************************************************************/
+int
+EGifSpewParallel(GifFileType *GifFileOut) 
+{
+    GifMemoryOutput *Outputs;
+    int i, Error = 0; 
+    
+    if (EGifPutScreenDesc(GifFileOut,
+                          GifFileOut->SWidth,
+                          GifFileOut->SHeight,
+                          GifFileOut->SColorResolution,
+                          GifFileOut->SBackGroundColor,
+                          GifFileOut->SColorMap) == GIF_ERROR) {
+        return (GIF_ERROR);
+    }
+
+    Outputs = (GifMemoryOutput *)calloc(GifFileOut->ImageCount > 0
+                                        ? GifFileOut->ImageCount : 1,
+                                        sizeof(GifMemoryOutput));
+    if (Outputs == NULL) {
+        GifFileOut->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return (GIF_ERROR);
+    }
+
+    /* One handle per thread, so that its dictionary is allocated once */
+    #pragma omp parallel
+    {
+        GifFileType *GifFile = EGifOpenMemory(GifFileOut);
+        int j;
+
+        /* Images differ in size: hand them out one at a time */
+        #pragma omp for schedule(dynamic)
+        for (j = 0; j < GifFileOut->ImageCount; j++) {
+            SavedImage *sp = &GifFileOut->SavedImages[j];
+
+            /* this allows us to delete images by nuking their rasters */
+            if (sp->RasterBits == NULL)
+                continue;
+            if (GifFile == NULL) {
+                Outputs[j].Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+                continue;
+            }
+            GifFile->UserData = &Outputs[j];
+            GifFile->Error = 0;
+            if (EGifSpewImage(GifFile, sp) == GIF_ERROR)
+                Outputs[j].Error = GifFile->Error ? GifFile->Error
+                                                  : E_GIF_ERR_WRITE_FAILED;
+        }
+        if (GifFile != NULL)
+            EGifCloseMemory(GifFile);
+    }
+
+    for (i = 0; i < GifFileOut->ImageCount; i++) {
+        if (Error == 0)
+            Error = Outputs[i].Error;
+        /* InternalWrite reports what it wrote as an int */
+        if (Error == 0 && Outputs[i].Len > 0
+            && (Outputs[i].Len > INT_MAX
+                || InternalWrite(GifFileOut, Outputs[i].Bytes, Outputs[i].Len)
+                   != (int)Outputs[i].Len))
+            Error = E_GIF_ERR_WRITE_FAILED;
+        free(Outputs[i].Bytes);
+    }
+    free(Outputs);
+    if (Error != 0) {
+        GifFileOut->Error = Error;
+        return (GIF_ERROR);
     }
 
     if (EGifWriteExtensions(GifFileOut,
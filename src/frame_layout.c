@@ -0,0 +1,94 @@
+/*
+ * INF560
+ *
+ * Padded frame layout shared by the stencils.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_layout.h"
+
+static int round_up(int n, int align)
+{
+    return (n + align - 1) / align * align;
+}
+
+void frame_layout_init(frame_layout* layout, int width, int height, int halo)
+{
+    if (halo < 1) {
+        halo = 1;
+    }
+    layout->width = width;
+    layout->height = height;
+    layout->halo = halo;
+    layout->pad = round_up(halo, FRAME_ALIGN);
+    layout->cols = round_up(width, FRAME_ALIGN);
+    layout->stride = layout->pad + layout->cols + layout->pad;
+    layout->origin = (long long int)halo * layout->stride + layout->pad;
+    layout->bytes = (long long int)(height + 2 * halo) * layout->stride;
+}
+
+void frame_fill_halo(unsigned char* frame, const frame_layout* layout)
+{
+    int width = layout->width;
+    int halo = layout->halo;
+    int pad = layout->pad;
+    int stride = layout->stride;
+    unsigned char* first = frame + layout->origin;
+    unsigned char* last = first + (long long int)(layout->height - 1) * stride;
+    int j;
+
+    if (width <= 0 || layout->height <= 0) {
+        memset(frame, 0, layout->bytes);
+        return;
+    }
+
+    for (j = 0; j < layout->height; j++) {
+        unsigned char* row = first + (long long int)j * stride;
+
+        memset(row - pad, 0, pad - halo);
+        memset(row - halo, row[0], halo);
+        memset(row + width, row[width - 1], halo);
+        memset(row + width + halo, 0, layout->cols + pad - width - halo);
+    }
+
+    /* Halo rows repeat the first and last rows, halo columns included */
+    for (j = 1; j <= halo; j++) {
+        memcpy(first - (long long int)j * stride - pad, first - pad, stride);
+        memcpy(last + (long long int)j * stride - pad, last - pad, stride);
+    }
+}
+
+void frame_pack(const unsigned char* frame, const frame_layout* layout, unsigned char* pixels)
+{
+    int j;
+
+    for (j = 0; j < layout->height; j++) {
+        memcpy(pixels + (long long int)j * layout->width,
+            frame + layout->origin + (long long int)j * layout->stride, layout->width);
+    }
+}
+
+void frame_unpack(const unsigned char* pixels, const frame_layout* layout, unsigned char* frame)
+{
+    int j;
+
+    for (j = 0; j < layout->height; j++) {
+        memcpy(frame + layout->origin + (long long int)j * layout->stride,
+            pixels + (long long int)j * layout->width, layout->width);
+    }
+    frame_fill_halo(frame, layout);
+}
+
+unsigned char* frame_alloc(long long int bytes)
+{
+    void* buffer = NULL;
+
+    /* An empty buffer is still a buffer, so NULL always means failure */
+    if (posix_memalign(&buffer, FRAME_ALIGN, bytes > 0 ? bytes : FRAME_ALIGN) != 0) {
+        fprintf(stderr, "Unable to allocate %lld bytes of frames\n", bytes);
+        return NULL;
+    }
+    return (unsigned char*)buffer;
+}
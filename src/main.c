@@ -8,33 +8,121 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 
+#include "blur_kernels.h"
+#include "frame_layout.h"
+#include "sobel_kernels.h"
  #include "cuda_functions.h"
 #include "gif_lib.h"
 
- /* Represent one pixel from the image */
-typedef struct pixel {
-    int r; /* Red */
-    int g; /* Green */
-    int b; /* Blue */
-} pixel;
+/*
+ * Represent the pixels of one image. Only gray images are ever expanded,
+ * so r, g and b all point to the same plane of gray levels.
+ */
+typedef struct pixel_planes {
+    unsigned char* r; /* Red */
+    unsigned char* g; /* Green */
+    unsigned char* b; /* Blue */
+} pixel_planes;
 
 /* Represent one GIF image (animated or not */
 typedef struct animated_gif {
     int n_images; /* Number of images */
     int* width; /* Width of each image */
     int* height; /* Height of each image */
-    pixel** p; /* Pixels of each image */
+    pixel_planes* p; /* Pixels of each image, NULL if not expanded */
+    int n_values; /* Number of gray levels in values, -1 if not known */
+    unsigned char values[256]; /* Gray levels of the pixels, in the order
+                                  they first appear */
     GifFileType* g; /* Internal representation.
                          DO NOT MODIFY */
 } animated_gif;
 
+/*
+ * Allocate the gray plane of an image of n_pixels pixels, which
+ * pixel_planes_free releases. r, g and b all point to it.
+ */
+static int pixel_planes_alloc(pixel_planes* p, long long int n_pixels)
+{
+    p->r = (unsigned char*)malloc(n_pixels);
+    if (p->r == NULL) {
+        return 0;
+    }
+    p->g = p->r;
+    p->b = p->r;
+    return 1;
+}
+
+static void pixel_planes_free(pixel_planes* p)
+{
+    free(p->r);
+}
+
+/* Gray level of a color, the average of its channels */
+static int gray_level(int r, int g, int b)
+{
+    int moy;
+
+    moy = (r + g + b) / 3;
+    if (moy < 0)
+        moy = 0;
+    if (moy > 255)
+        moy = 255;
+    return moy;
+}
+
+/*
+ * Gray level of every entry of a colormap: with a palette, gray is a
+ * function of the color index alone. Entries past the end of the
+ * colormap are black.
+ */
+static void gray_lut(const ColorMapObject* colmap, unsigned char* lut)
+{
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        lut[c] = 0;
+        if (c < colmap->ColorCount) {
+            lut[c] = gray_level(colmap->Colors[c].Red,
+                colmap->Colors[c].Green, colmap->Colors[c].Blue);
+        }
+    }
+}
+
+/* Give an image that was not expanded one gray plane per frame, left as is */
+static int animated_gif_alloc_gray(animated_gif* image)
+{
+    int i;
+
+    image->p = (pixel_planes*)malloc(image->n_images * sizeof(pixel_planes));
+    if (image->p == NULL) {
+        fprintf(stderr, "Unable to allocate array of %d images\n", image->n_images);
+        return 0;
+    }
+    for (i = 0; i < image->n_images; i++) {
+        if (!pixel_planes_alloc(&image->p[i],
+                (long long int)image->width[i] * image->height[i])) {
+            fprintf(stderr, "Unable to allocate gray plane of image %d\n", i);
+            while (i-- > 0) {
+                pixel_planes_free(&image->p[i]);
+            }
+            free(image->p);
+            image->p = NULL;
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /*
  * Load a GIF image from a file and return a
- * structure of type animated_gif.
+ * structure of type animated_gif. The pixels are not
+ * expanded: they are read from the color indices.
  */
 animated_gif*
 load_pixels(char* filename)
@@ -45,7 +133,6 @@ load_pixels(char* filename)
     int n_images;
     int* width;
     int* height;
-    pixel** p;
     int i;
     animated_gif* image;
 
@@ -94,29 +181,8 @@ load_pixels(char* filename)
         return NULL;
     }
 
-    /* Allocate the array of pixels to be returned */
-    p = (pixel**)malloc(n_images * sizeof(pixel*));
-    if (p == NULL) {
-        fprintf(stderr, "Unable to allocate array of %d images\n",
-            n_images);
-        return NULL;
-    }
-
-    for (i = 0; i < n_images; i++) {
-        p[i] = (pixel*)malloc(width[i] * height[i] * sizeof(pixel));
-        if (p[i] == NULL) {
-            fprintf(stderr, "Unable to allocate %d-th array of %d pixels\n",
-                i, width[i] * height[i]);
-            return NULL;
-        }
-    }
-
-    /* Fill pixels */
-
     /* For each image */
     for (i = 0; i < n_images; i++) {
-        int j;
-
         /* Get the local colormap if needed */
         if (g->SavedImages[i].ImageDesc.ColorMap) {
 
@@ -126,17 +192,6 @@ load_pixels(char* filename)
 
             colmap = g->SavedImages[i].ImageDesc.ColorMap;
         }
-
-        /* Traverse the image and fill pixels */
-        for (j = 0; j < width[i] * height[i]; j++) {
-            int c;
-
-            c = g->SavedImages[i].RasterBits[j];
-
-            p[i][j].r = colmap->Colors[c].Red;
-            p[i][j].g = colmap->Colors[c].Green;
-            p[i][j].b = colmap->Colors[c].Blue;
-        }
     }
 
     /* Allocate image info */
@@ -150,7 +205,8 @@ load_pixels(char* filename)
     image->n_images = n_images;
     image->width = width;
     image->height = height;
-    image->p = p;
+    image->p = NULL;
+    image->n_values = -1;
     image->g = g;
 
     return image;
@@ -179,7 +235,8 @@ int output_modified_read_gif(char* filename, GifFileType* g)
     g2->ExtensionBlockCount = g->ExtensionBlockCount;
     g2->ExtensionBlocks = g->ExtensionBlocks;
 
-    error2 = EGifSpew(g2);
+    /* Frames are compressed in parallel, the file is the same */
+    error2 = EGifSpewParallel(g2);
     if (error2 != GIF_OK) {
         fprintf(stderr, "Error after writing g2: %d <%s>\n",
             error2, GifErrorString(g2->Error));
@@ -189,12 +246,254 @@ int output_modified_read_gif(char* filename, GifFileType* g)
     return 1;
 }
 
+/*
+ * Palette index of each color met by store_pixels, found in constant
+ * time. Gray colors, the only ones once the image is gray, go in a table
+ * indexed by their level and the others in a small hash table with
+ * linear probing. A palette has at most 256 colors, so the hash table is
+ * never more than half full.
+ */
+#define COLOR_INDEX_SLOTS 512
+
+typedef struct color_index {
+    short gray[256];                      /* Index of (v, v, v), -1 if none */
+    unsigned int keys[COLOR_INDEX_SLOTS]; /* 0xRRGGBB */
+    short values[COLOR_INDEX_SLOTS];      /* -1 for an empty slot */
+} color_index;
+
+static void color_index_init(color_index* index)
+{
+    memset(index->gray, -1, sizeof(index->gray));
+    memset(index->values, -1, sizeof(index->values));
+}
+
+/* Slot of key, or the empty slot where it would go */
+static int color_index_slot(const color_index* index, unsigned int key)
+{
+    int s = (key * 2654435761u) >> 23;
+
+    while (index->values[s] != -1 && index->keys[s] != key) {
+        s = (s + 1) & (COLOR_INDEX_SLOTS - 1);
+    }
+    return s;
+}
+
+/* Palette index of (r, g, b), -1 if it has none */
+static int color_index_find(const color_index* index, int r, int g, int b)
+{
+    if (r == g && g == b) {
+        return index->gray[r];
+    }
+    return index->values[color_index_slot(index, (r << 16) | (g << 8) | b)];
+}
+
+static void color_index_set(color_index* index, int r, int g, int b, int value)
+{
+    unsigned int key = (r << 16) | (g << 8) | b;
+    int s;
+
+    if (r == g && g == b) {
+        index->gray[r] = value;
+        return;
+    }
+    s = color_index_slot(index, key);
+    index->keys[s] = key;
+    index->values[s] = value;
+}
+
+/* Append (r, g, b) to the n_colors entries of colormap unless it is there */
+static int colormap_add(GifColorType* colormap, int* n_colors, color_index* index,
+    int r, int g, int b)
+{
+    if (color_index_find(index, r, g, b) != -1) {
+        return 1;
+    }
+    if (*n_colors >= 256) {
+        fprintf(stderr,
+            "Error: Found too many colors inside the image\n");
+        return 0;
+    }
+
+    colormap[*n_colors].Red = r;
+    colormap[*n_colors].Green = g;
+    colormap[*n_colors].Blue = b;
+    color_index_set(index, r, g, b, *n_colors);
+    (*n_colors)++;
+    return 1;
+}
+
+/*
+ * Colors met by one thread while discovering the palette, with where
+ * each of them first appears (pixels of all frames numbered one after
+ * the other). Sorting the union of the sets by that position gives the
+ * colors in the order a single scan would find them.
+ */
+typedef struct color_seen {
+    long long int first;
+    GifByteType r, g, b;
+} color_seen;
+
+typedef struct color_set {
+    color_index index; /* Position of each color in colors */
+    int n_colors;      /* -1 once there are more than 256 */
+    color_seen colors[256];
+} color_set;
+
+static void color_set_init(color_set* set)
+{
+    color_index_init(&set->index);
+    set->n_colors = 0;
+}
+
+static void color_set_add(color_set* set, int r, int g, int b, long long int position)
+{
+    int c = color_index_find(&set->index, r, g, b);
+
+    if (c != -1) {
+        if (position < set->colors[c].first) {
+            set->colors[c].first = position;
+        }
+        return;
+    }
+    if (set->n_colors >= 256) {
+        set->n_colors = -1;
+        return;
+    }
+    c = set->n_colors++;
+    set->colors[c].first = position;
+    set->colors[c].r = r;
+    set->colors[c].g = g;
+    set->colors[c].b = b;
+    color_index_set(&set->index, r, g, b, c);
+}
+
+static int color_seen_compare(const void* a, const void* b)
+{
+    long long int x = ((const color_seen*)a)->first;
+    long long int y = ((const color_seen*)b)->first;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Add the colors of the pixels of image to colormap, in the order they
+ * first appear. The threads each scan a share of the rows of every frame.
+ */
+static int colormap_add_pixels(GifColorType* colormap, int* n_colors, color_index* index,
+    const animated_gif* image)
+{
+    int n_threads = omp_get_max_threads();
+    color_set* sets = (color_set*)malloc((n_threads + 1) * sizeof(color_set));
+    color_set* all;
+    int t, c;
+
+    if (sets == NULL) {
+        fprintf(stderr, "Unable to allocate %d color sets\n", n_threads + 1);
+        return 0;
+    }
+    for (t = 0; t <= n_threads; t++) {
+        color_set_init(&sets[t]);
+    }
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        color_set* set = &sets[omp_get_thread_num()];
+        long long int base = 0;
+
+        for (int i = 0; i < image->n_images; i++) {
+            const pixel_planes* p = &image->p[i];
+            int width = image->width[i];
+
+            /* A thread has its rows in increasing order across frames */
+            #pragma omp for schedule(static) nowait
+            for (int j = 0; j < image->height[i]; j++) {
+                long long int first = (long long int)j * width;
+
+                for (int k = 0; k < width && set->n_colors >= 0; k++) {
+                    color_set_add(set, p->r[first + k], p->g[first + k], p->b[first + k],
+                        base + first + k);
+                }
+            }
+            base += (long long int)width * image->height[i];
+        }
+    }
+
+    /* Merge the sets of the threads into the last one */
+    all = &sets[n_threads];
+    for (t = 0; t < n_threads && all->n_colors >= 0; t++) {
+        if (sets[t].n_colors < 0) {
+            all->n_colors = -1;
+            break;
+        }
+        for (c = 0; c < sets[t].n_colors && all->n_colors >= 0; c++) {
+            const color_seen* seen = &sets[t].colors[c];
+
+            color_set_add(all, seen->r, seen->g, seen->b, seen->first);
+        }
+    }
+    if (all->n_colors < 0) {
+        fprintf(stderr,
+            "Error: Found too many colors inside the image\n");
+        free(sets);
+        return 0;
+    }
+
+    qsort(all->colors, all->n_colors, sizeof(color_seen), color_seen_compare);
+    for (c = 0; c < all->n_colors; c++) {
+        if (!colormap_add(colormap, n_colors, index,
+                all->colors[c].r, all->colors[c].g, all->colors[c].b)) {
+            free(sets);
+            return 0;
+        }
+    }
+    free(sets);
+    return 1;
+}
+
+/*
+ * Write the color indices of the pixels of image into its RasterBits,
+ * frames and rows shared between the threads
+ */
+static int raster_remap(animated_gif* image, const color_index* index)
+{
+    int missing = 0;
+
+    #pragma omp parallel reduction(|:missing)
+    for (int i = 0; i < image->n_images; i++) {
+        const pixel_planes* p = &image->p[i];
+        GifByteType* raster = image->g->SavedImages[i].RasterBits;
+        int width = image->width[i];
+
+        #pragma omp for schedule(static) nowait
+        for (int j = 0; j < image->height[i]; j++) {
+            long long int first = (long long int)j * width;
+
+            /* The image is gray: remapped through the table of its 256 levels */
+            for (int k = 0; k < width; k++) {
+                int found_index = index->gray[p->r[first + k]];
+
+                missing |= found_index == -1;
+                raster[first + k] = found_index;
+            }
+        }
+    }
+
+    if (missing) {
+        fprintf(stderr,
+            "Error: Unable to find a pixel in the color map\n");
+        return 0;
+    }
+    return 1;
+}
+
 int store_pixels(char* filename, animated_gif* image)
 {
     int n_colors = 0;
-    pixel** p;
-    int i, j, k;
+    int n_found;
+    int i;
+    long long int j;
     GifColorType* colormap;
+    color_index index;
 
     /* Initialize the new set of colors */
     colormap = (GifColorType*)malloc(256 * sizeof(GifColorType));
@@ -225,6 +524,8 @@ int store_pixels(char* filename, animated_gif* image)
     colormap[0].Red = moy;
     colormap[0].Green = moy;
     colormap[0].Blue = moy;
+    color_index_init(&index);
+    color_index_set(&index, moy, moy, moy, 0);
 
     image->g->SBackGroundColor = 0;
 
@@ -251,14 +552,7 @@ int store_pixels(char* filename, animated_gif* image)
                 if (moy > 255)
                     moy = 255;
 
-                for (k = 0; k < n_colors; k++) {
-                    if (
-                        moy == colormap[k].Red
-                        && moy == colormap[k].Green
-                        && moy == colormap[k].Blue) {
-                        found = k;
-                    }
-                }
+                found = color_index_find(&index, moy, moy, moy);
                 if (found == -1) {
                     if (n_colors >= 256) {
                         fprintf(stderr,
@@ -270,6 +564,7 @@ int store_pixels(char* filename, animated_gif* image)
                     colormap[n_colors].Green = moy;
                     colormap[n_colors].Blue = moy;
 
+                    color_index_set(&index, moy, moy, moy, n_colors);
                     image->g->ExtensionBlocks[j].Bytes[3] = n_colors;
 
                     n_colors++;
@@ -302,14 +597,7 @@ int store_pixels(char* filename, animated_gif* image)
                     if (moy > 255)
                         moy = 255;
 
-                    for (k = 0; k < n_colors; k++) {
-                        if (
-                            moy == colormap[k].Red
-                            && moy == colormap[k].Green
-                            && moy == colormap[k].Blue) {
-                            found = k;
-                        }
-                    }
+                    found = color_index_find(&index, moy, moy, moy);
                     if (found == -1) {
                         if (n_colors >= 256) {
                             fprintf(stderr,
@@ -321,6 +609,7 @@ int store_pixels(char* filename, animated_gif* image)
                         colormap[n_colors].Green = moy;
                         colormap[n_colors].Blue = moy;
 
+                        color_index_set(&index, moy, moy, moy, n_colors);
                         image->g->SavedImages[i].ExtensionBlocks[j].Bytes[3] = n_colors;
 
                         n_colors++;
@@ -333,34 +622,26 @@ int store_pixels(char* filename, animated_gif* image)
         }
     }
 
-    p = image->p;
-    /* Find the number of colors inside the image */
-    for (i = 0; i < image->n_images; i++) {
-
-        for (j = 0; j < image->width[i] * image->height[i]; j++) {
-            int found = 0;
-            for (k = 0; k < n_colors; k++) {
-                if (p[i][j].r == colormap[k].Red && p[i][j].g == colormap[k].Green && p[i][j].b == colormap[k].Blue) {
-                    found = 1;
-                }
-            }
-
-            if (found == 0) {
-                if (n_colors >= 256) {
-                    fprintf(stderr,
-                        "Error: Found too many colors inside the image\n");
-                    return 0;
-                }
+    if (image->n_values >= 0) {
+        /*
+         * Whoever wrote the pixels listed their gray levels in the order
+         * they first appear: that is the order the scan below would find
+         * them in.
+         */
+        for (i = 0; i < image->n_values; i++) {
+            int v = image->values[i];
 
-                colormap[n_colors].Red = p[i][j].r;
-                colormap[n_colors].Green = p[i][j].g;
-                colormap[n_colors].Blue = p[i][j].b;
-                n_colors++;
+            if (!colormap_add(colormap, &n_colors, &index, v, v, v)) {
+                return 0;
             }
         }
     }
+    else if (!colormap_add_pixels(colormap, &n_colors, &index, image)) {
+        return 0;
+    }
 
     /* Round up to a power of 2 */
+    n_found = n_colors;
     if (n_colors != (1 << GifBitSize(n_colors))) {
         n_colors = (1 << GifBitSize(n_colors));
     }
@@ -377,200 +658,968 @@ int store_pixels(char* filename, animated_gif* image)
 
     image->g->SColorMap = cmo;
 
+    /*
+     * The entries added by the rounding are white, and white pixels have
+     * always been given the last entry that matches
+     */
+    if (n_colors > n_found) {
+        color_index_set(&index, 255, 255, 255, n_colors - 1);
+    }
+
     /* Update the raster bits according to color map */
-    for (i = 0; i < image->n_images; i++) {
-        for (j = 0; j < image->width[i] * image->height[i]; j++) {
-            int found_index = -1;
-            for (k = 0; k < n_colors; k++) {
-                if (p[i][j].r == image->g->SColorMap->Colors[k].Red && p[i][j].g == image->g->SColorMap->Colors[k].Green && p[i][j].b == image->g->SColorMap->Colors[k].Blue) {
-                    found_index = k;
+    if (!raster_remap(image, &index)) {
+        return 0;
+    }
+
+    /* Write the final image */
+    if (!output_modified_read_gif(filename, image->g)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Offset of pixel (l, c) in rows of nb_c, computed in 64 bits */
+#define CONV(l, c, nb_c) \
+    ((long long int)(l) * (nb_c) + (c))
+
+/*
+ * What the blur helpers need to know about the current call. The inner
+ * loops live in blur_kernels.c, in one flavour per instruction set, and
+ * row is the row kernel compiled for this radius if there is one. Rows
+ * are stride bytes apart and the column sums run over all cols columns of
+ * the padded rows (see frame_layout.h), which needs no tail loop.
+ */
+typedef struct blur_params {
+    const blur_kernels* kernels;
+    blur_row_fn row;
+    blur_divisor divisor;
+    int size;
+    int threshold;
+    int width;
+    int stride;
+    int cols;
+    int n_threads;
+} blur_params;
+
+/*
+ * Per-thread scratch of the blur: the 16-bit column sums of a row (cols
+ * of them) and the 32-bit sums the row kernels need (width + 1).
+ */
+typedef struct blur_work {
+    unsigned short* colsum;
+    unsigned int* scratch;
+} blur_work;
+
+/*
+ * Blur rows [j_begin, j_end) of src into dst with a (2*size+1)^2 box
+ * stencil. The box sum is separable: colsum[k] holds the vertical sum of
+ * the 2*size+1 rows around j and slides down one row at a time, and the
+ * horizontal sum is taken along colsum. Each pixel costs O(1) whatever
+ * the radius, and the integer result is the same as the direct stencil.
+ *
+ * changed[j] is set to 1 if row j differs from src at all, 0 otherwise.
+ * Returns 1 if no written pixel moved by more than threshold from src.
+ */
+static int blur_rows_running_sum(const blur_params* bp, const unsigned char* src,
+    unsigned char* dst, const blur_work* work, char* changed, int j_begin, int j_end)
+{
+    int j, r;
+    int size = bp->size;
+    int width = bp->width;
+    int stride = bp->stride;
+    unsigned short* colsum = work->colsum;
+    int end = 1;
+
+    if (j_begin >= j_end || size >= width - size) {
+        return 1;
+    }
+
+    memset(colsum, 0, bp->cols * sizeof(unsigned short));
+    for (r = j_begin - size; r <= j_begin + size; r++) {
+        bp->kernels->colsum_add(colsum, src + CONV(r, 0, stride), bp->cols);
+    }
+
+    for (j = j_begin; j < j_end; j++) {
+        int moved;
+
+        if (j > j_begin) {
+            bp->kernels->colsum_slide(colsum, src + CONV(j + size, 0, stride),
+                src + CONV(j - size - 1, 0, stride), bp->cols);
+        }
+        end &= bp->row(colsum, src + CONV(j, 0, stride), dst + CONV(j, 0, stride),
+            work->scratch, size, &bp->divisor, bp->threshold, width, &moved);
+        changed[j] = moved;
+    }
+
+    return end;
+}
+
+/*
+ * One of the two blurred bands. Rows [begin, end) are blurred, which
+ * reads the size-row halo on each side. buf[0] points into the frame at
+ * row begin - size and buf[1] is a private copy of the same rows, padding
+ * included (copy is its allocation); the iterations ping-pong between the
+ * two so the rest of the frame is never read or written.
+ *
+ * changed[c][r] tells whether window row r of buf[c] differs from the
+ * other buffer, i.e. whether the iteration that produced buf[c] moved it.
+ */
+typedef struct blur_band {
+    int begin;
+    int end;
+    unsigned char* buf[2];
+    unsigned char* copy;
+    char* changed[2];
+} blur_band;
+
+/* Forget what is known about buf[c]: every blurred row counts as moved */
+static void blur_band_mark_moved(blur_band* band, int c, int size)
+{
+    if (band->begin >= band->end) {
+        return;
+    }
+    memset(band->changed[c], 0, band->end - band->begin + 2 * size);
+    memset(band->changed[c] + size, 1, band->end - band->begin);
+}
+
+/*
+ * Rows [*begin, *end) blurred by band b of a frame: the top and bottom
+ * parts of the image (10%), without the size-row borders. Empty if
+ * *begin >= *end.
+ */
+static void blur_band_rows(int b, int size, int height, int* begin, int* end)
+{
+    if (b == 0) {
+        *begin = size;
+        *end = height / 10 - size;
+    }
+    else {
+        *begin = height * 0.9 + size;
+        *end = height - size;
+    }
+}
+
+static int blur_band_init(blur_band* band, unsigned char* image, int size,
+    const frame_layout* layout, int begin, int end)
+{
+    int rows = end - begin + 2 * size;
+    long bytes = (long)rows * layout->stride;
+
+    band->begin = begin;
+    band->end = end;
+    band->buf[0] = NULL;
+    band->buf[1] = NULL;
+    band->copy = NULL;
+    band->changed[0] = NULL;
+    band->changed[1] = NULL;
+    if (begin >= end) {
+        return 1;
+    }
+
+    band->buf[0] = image + CONV(begin - size, 0, layout->stride);
+    band->copy = frame_alloc(bytes);
+    band->changed[0] = (char*)malloc(2 * rows);
+    if (band->copy == NULL || band->changed[0] == NULL) {
+        fprintf(stderr, "Unable to allocate blur band of %d rows\n", rows);
+        free(band->copy);
+        free(band->changed[0]);
+        band->copy = NULL;
+        band->changed[0] = NULL;
+        return 0;
+    }
+    band->buf[1] = band->copy + layout->pad;
+    band->changed[1] = band->changed[0] + rows;
+    memcpy(band->copy, band->buf[0] - layout->pad, bytes);
+
+    /* Nothing is known about the input yet */
+    memset(band->changed[1], 0, rows);
+    blur_band_mark_moved(band, 0, size);
+    return 1;
+}
+
+static void blur_band_free(blur_band* band)
+{
+    free(band->copy);
+    free(band->changed[0]);
+}
+
+/*
+ * Blurred rows of block t when a band is split in blocks for the threads,
+ * as window rows [*j_begin, *j_end).
+ */
+static void blur_band_block(const blur_band* band, int size, int t, int blocks,
+    int* j_begin, int* j_end)
+{
+    int rows = band->end - band->begin;
+
+    *j_begin = size + (int)((long)rows * t / blocks);
+    *j_end = size + (int)((long)rows * (t + 1) / blocks);
+}
+
+/*
+ * Run one iteration on window rows [j_begin, j_end) of a band, from
+ * buf[cur] into buf[1 - cur].
+ *
+ * A row only has to be recomputed if one of the 2*size+1 rows it reads
+ * moved during the previous iteration. Otherwise its blurred value is the
+ * one it already has, and buf[1 - cur] holds it too: the row did not move
+ * either, so both buffers agree on it. Runs of rows that need work are
+ * handed to the running-sum kernel, skipped rows are left alone.
+ */
+static int blur_band_iterate(const blur_params* bp, blur_band* band, int cur,
+    const blur_work* work, int j_begin, int j_end)
+{
+    int j;
+    int size = bp->size;
+    int moved = 0;
+    int run_begin = -1;
+    const char* prev = band->changed[cur];
+    char* next = band->changed[1 - cur];
+    int end = 1;
+
+    if (j_begin >= j_end) {
+        return 1;
+    }
+
+    memset(next + j_begin, 0, j_end - j_begin);
+    for (j = j_begin - size; j < j_begin + size; j++) {
+        moved += prev[j];
+    }
+    for (j = j_begin; j < j_end; j++) {
+        moved += prev[j + size];
+        if (moved > 0 && run_begin < 0) {
+            run_begin = j;
+        }
+        else if (moved == 0 && run_begin >= 0) {
+            end &= blur_rows_running_sum(bp, band->buf[cur], band->buf[1 - cur], work, next,
+                run_begin, j);
+            run_begin = -1;
+        }
+        moved -= prev[j - size];
+    }
+    if (run_begin >= 0) {
+        end &= blur_rows_running_sum(bp, band->buf[cur], band->buf[1 - cur], work, next,
+            run_begin, j_end);
+    }
+
+    return end;
+}
+
+/*
+ * Temporal blocking. Once the bands no longer fit in L2, every iteration
+ * streams them from memory. The wavefront schedule below advances a band
+ * by several iterations in one sweep: level l computes row j - l*size of
+ * iteration t + l while level l - 1 is at row j - (l-1)*size, so every
+ * level only keeps 2*size+2 rows alive in a small ring.
+ *
+ * With several threads each one sweeps a block of rows. Level l of a
+ * block also computes the (steps - l)*size rows on each side that the
+ * levels above read, so blocks never wait on each other (trapezoids).
+ * Every block has its own rings and column sums.
+ */
+#define BLUR_MAX_STEPS 8
+
+typedef struct blur_wavefront {
+    int steps;
+    int ring_rows;
+    int blocks;
+    int stride;
+    int cols;
+    long ring_pixels;
+    long colsum_len;
+    unsigned char* rings;
+    unsigned short* colsums;
+    unsigned int* scratch;
+} blur_wavefront;
+
+/* Cache size the band footprint is compared against */
+static long blur_cache_bytes(void)
+{
+    long bytes = -1;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (bytes <= 0) {
+        bytes = 1 << 20;
+    }
+    return bytes;
+}
+
+/*
+ * Size the wavefront so its rings fill about half of L2, and so that the
+ * redundant rows of a block stay within a quarter of it. Returns 0 if
+ * temporal blocking is not worth it (or not possible), 1 otherwise.
+ */
+static int blur_wavefront_init(blur_wavefront* wf, const blur_band* bands,
+    const blur_params* bp, int blocks)
+{
+    int size = bp->size;
+    int width = bp->width;
+    long cache = blur_cache_bytes();
+    long footprint = 0;
+    long level_bytes;
+    int block_rows = 0;
+    int b;
+
+    wf->rings = NULL;
+    wf->colsums = NULL;
+    wf->scratch = NULL;
+
+    /* A single pass (threshold <= 0) has nothing to block */
+    if (bp->threshold <= 0) {
+        return 0;
+    }
+    for (b = 0; b < 2; b++) {
+        int rows = bands[b].end - bands[b].begin;
+
+        if (rows > 0) {
+            footprint += 2L * (rows + 2 * size) * bp->stride;
+            if (block_rows == 0 || rows / blocks < block_rows) {
+                block_rows = rows / blocks;
+            }
+        }
+    }
+    if (footprint <= cache || size >= width - size) {
+        return 0;
+    }
+
+    /* Ring rows are only summed, so they are cols wide with no halo */
+    wf->ring_rows = 2 * size + 2;
+    wf->blocks = blocks;
+    wf->stride = bp->stride;
+    wf->cols = bp->cols;
+    level_bytes = (long)wf->ring_rows * wf->cols + wf->cols * sizeof(unsigned short);
+    wf->steps = cache / 2 / level_bytes;
+    if (wf->steps > BLUR_MAX_STEPS) {
+        wf->steps = BLUR_MAX_STEPS;
+    }
+    if (blocks > 1 && size > 0 && wf->steps > 1 + block_rows / (4 * size)) {
+        wf->steps = 1 + block_rows / (4 * size);
+    }
+    if (wf->steps < 2) {
+        return 0;
+    }
+
+    /* Per block: one ring per intermediate level, one colsum per level */
+    wf->ring_pixels = (long)(wf->steps - 1) * wf->ring_rows * wf->cols;
+    wf->colsum_len = (long)wf->steps * wf->cols;
+    wf->rings = frame_alloc(blocks * wf->ring_pixels);
+    wf->colsums = (unsigned short*)malloc(blocks * wf->colsum_len * sizeof(unsigned short));
+    wf->scratch = (unsigned int*)malloc(blocks * (width + 1L) * sizeof(unsigned int));
+    if (wf->rings == NULL || wf->colsums == NULL || wf->scratch == NULL) {
+        free(wf->rings);
+        free(wf->colsums);
+        free(wf->scratch);
+        wf->rings = NULL;
+        wf->colsums = NULL;
+        wf->scratch = NULL;
+        return 0;
+    }
+    /* The padding of ring rows is summed too: give it a value */
+    memset(wf->rings, 0, blocks * wf->ring_pixels);
+    return 1;
+}
+
+static void blur_wavefront_free(blur_wavefront* wf)
+{
+    free(wf->rings);
+    free(wf->colsums);
+    free(wf->scratch);
+}
+
+/*
+ * Where window row j of iteration level lives while block t sweeps:
+ * halo rows never change and level 0 is the source buffer, the last level
+ * goes straight to the destination buffer and the others to their ring.
+ */
+static unsigned char* blur_wavefront_row(const blur_wavefront* wf, const blur_band* band, int cur,
+    int t, int level, int j, int size)
+{
+    if (level == 0 || j < size || j >= size + band->end - band->begin) {
+        return band->buf[cur] + CONV(j, 0, wf->stride);
+    }
+    if (level == wf->steps) {
+        return band->buf[1 - cur] + CONV(j, 0, wf->stride);
+    }
+    return wf->rings + t * wf->ring_pixels
+        + CONV((level - 1) * wf->ring_rows + j % wf->ring_rows, 0, wf->cols);
+}
+
+/*
+ * Advance block t of a band by wf->steps iterations from buf[cur] into
+ * buf[1 - cur]. ends[l] is cleared if iteration l + 1 of the sweep moved
+ * a pixel by more than threshold, which is what the step-by-step loop
+ * would have seen. Returns the number of rows of the block that still
+ * moved in the last iteration.
+ */
+static int blur_band_wavefront(const blur_params* bp, const blur_wavefront* wf,
+    blur_band* band, int cur, int t, int* ends)
+{
+    int i, l;
+    int size = bp->size;
+    int width = bp->width;
+    int j_begin, j_end;
+    int window_end = size + band->end - band->begin;
+    unsigned short* colsums = wf->colsums + t * wf->colsum_len;
+    unsigned int* scratch = wf->scratch + t * (width + 1L);
+    int moved_rows = 0;
+
+    blur_band_block(band, size, t, wf->blocks, &j_begin, &j_end);
+    if (j_begin >= j_end) {
+        return 0;
+    }
+
+    for (i = j_begin - (wf->steps - 1) * size + size; i < j_end + wf->steps * size; i++) {
+        for (l = 1; l <= wf->steps; l++) {
+            int j = i - l * size;
+            int lo = j_begin - (wf->steps - l) * size;
+            int hi = j_end + (wf->steps - l) * size;
+            unsigned short* colsum = colsums + CONV(l - 1, 0, wf->cols);
+            const unsigned char* old;
+            unsigned char* row;
+            int moved;
+            int r;
+
+            if (lo < size) {
+                lo = size;
+            }
+            if (hi > window_end) {
+                hi = window_end;
+            }
+            if (j < lo || j >= hi) {
+                continue;
+            }
+
+            if (j == lo) {
+                memset(colsum, 0, wf->cols * sizeof(unsigned short));
+                for (r = j - size; r <= j + size; r++) {
+                    bp->kernels->colsum_add(colsum,
+                        blur_wavefront_row(wf, band, cur, t, l - 1, r, size), wf->cols);
                 }
             }
+            else {
+                bp->kernels->colsum_slide(colsum,
+                    blur_wavefront_row(wf, band, cur, t, l - 1, j + size, size),
+                    blur_wavefront_row(wf, band, cur, t, l - 1, j - size - 1, size),
+                    wf->cols);
+            }
 
-            if (found_index == -1) {
-                fprintf(stderr,
-                    "Error: Unable to find a pixel in the color map\n");
-                return 0;
+            old = blur_wavefront_row(wf, band, cur, t, l - 1, j, size);
+            row = blur_wavefront_row(wf, band, cur, t, l, j, size);
+            if (l < wf->steps) {
+                /* Ring rows also need the columns the blur leaves alone */
+                memcpy(row, old, size);
+                memcpy(row + width - size, old + width - size, size);
+            }
+            ends[l - 1] &= bp->row(colsum, old, row, scratch,
+                size, &bp->divisor, bp->threshold, width, &moved);
+            if (l == wf->steps) {
+                moved_rows += moved;
             }
-
-            image->g->SavedImages[i].RasterBits[j] = found_index;
         }
     }
-    /* Write the final image */
-    if (!output_modified_read_gif(filename, image->g)) {
-        return 0;
-    }
 
-    return 1;
+    return moved_rows;
 }
 
-void apply_gray_filter(animated_gif* image)
+/*
+ * Blur the top and bottom 10% of a frame until no pixel moves by more than
+ * threshold. Each band is split in n_threads blocks of rows for OpenMP.
+ *
+ * The blurred rows are left wherever the last iteration put them: the
+ * return value is the buffer of bands[] that holds them, or -1 if the
+ * frame could not be blurred (bands[] are then empty). The caller frees
+ * the bands. image points to pixel (0, 0) of a frame laid out as layout.
+ */
+static int blur_frame(unsigned char* image, int size, int threshold, const frame_layout* layout,
+    int n_threads, blur_band* bands)
 {
-    int i, j;
-    pixel** p;
-
-    p = image->p;
+    int width = layout->width;
+    int height = layout->height;
+    int b, l, n, t;
+    int begin, end;
+    int cur;
+    int use_wavefront;
+    int ends[BLUR_MAX_STEPS];
+    blur_wavefront wf;
+    blur_params bp;
+    unsigned short* colsums;
+    unsigned int* scratch;
+
+    for (b = 0; b < 2; b++) {
+        blur_band_init(&bands[b], image, size, layout, 0, 0);
+    }
 
-    for (i = 0; i < image->n_images; i++) {
-        for (j = 0; j < image->width[i] * image->height[i]; j++) {
-            int moy;
+    colsums = (unsigned short*)malloc((long)n_threads * layout->cols * sizeof(unsigned short));
+    scratch = (unsigned int*)malloc(n_threads * (width + 1L) * sizeof(unsigned int));
+    if (colsums == NULL || scratch == NULL) {
+        fprintf(stderr, "Unable to allocate blur work of %d threads\n", n_threads);
+        free(colsums);
+        free(scratch);
+        return -1;
+    }
 
-            moy = (p[i][j].r + p[i][j].g + p[i][j].b) / 3;
-            if (moy < 0)
-                moy = 0;
-            if (moy > 255)
-                moy = 255;
+    bp.kernels = blur_kernels_select();
+    bp.row = blur_kernels_row(bp.kernels, size);
+    bp.size = size;
+    bp.threshold = threshold;
+    bp.width = width;
+    bp.stride = layout->stride;
+    bp.cols = layout->cols;
+    bp.n_threads = n_threads;
+
+    /* Pixels are at most 255, so box sums are at most 255 * n */
+    n = (2 * size + 1) * (2 * size + 1);
+    if (size > BLUR_KERNELS_MAX_SIZE || !blur_divisor_init(&bp.divisor, n, 255 * n)) {
+        fprintf(stderr, "Unsupported blur size %d\n", size);
+        free(colsums);
+        free(scratch);
+        return -1;
+    }
 
-            p[i][j].r = moy;
-            p[i][j].g = moy;
-            p[i][j].b = moy;
+    /* Blur is applied on the top and bottom parts of the image (10%) */
+    for (b = 0; b < 2; b++) {
+        blur_band_rows(b, size, height, &begin, &end);
+        if (!blur_band_init(&bands[b], image, size, layout, begin, end)) {
+            blur_band_free(&bands[0]);
+            blur_band_init(&bands[0], image, size, layout, 0, 0);
+            blur_band_init(&bands[1], image, size, layout, 0, 0);
+            free(colsums);
+            free(scratch);
+            return -1;
         }
     }
-}
 
-#define CONV(l, c, nb_c) \
-    (l) * (nb_c) + (c)
-void apply_blur_filter_flattened_array(int* image, int size, int threshold, int width, int height)
-{
-    int i, j, k;
-    int end;
-    i = 0;
+    use_wavefront = blur_wavefront_init(&wf, bands, &bp, n_threads);
 
-    int* new_image = (int*)malloc(width * height * sizeof(int));
+    /*
+     * Ping-pong each band between the frame and its private copy. Halo
+     * rows are never written, so both copies agree on them and each
+     * iteration only has to produce the blurred rows that can still move.
+     */
+    cur = 0;
     do {
-        end = 1;
-        for (j = 0; j < height - 1; j++) {
-            for (k = 0; k < width - 1; k++) {
-                new_image[CONV(j, k, width)] = image[i * width * height + CONV(j, k, width)];
+        if (use_wavefront) {
+            int moved_rows = 0;
+            int total_rows = 0;
+            int first_end = -1;
+
+            for (l = 0; l < wf.steps; l++) {
+                ends[l] = 1;
+            }
+            for (b = 0; b < 2; b++) {
+                if (bands[b].begin >= bands[b].end) {
+                    continue;
+                }
+                #pragma omp parallel for num_threads(n_threads) reduction(+:moved_rows) reduction(&:ends[:BLUR_MAX_STEPS])
+                for (t = 0; t < wf.blocks; t++) {
+                    moved_rows += blur_band_wavefront(&bp, &wf, &bands[b], cur, t, ends);
+                }
+                total_rows += bands[b].end - bands[b].begin;
+            }
+            for (l = 0; l < wf.steps && first_end < 0; l++) {
+                if (ends[l]) {
+                    first_end = l;
+                }
             }
-        }
-        /* Apply blur on top part of image (10%) */
-        for (j = size; j < height / 10 - size; j++) {
-            for (k = size; k < width - size; k++) {
-                int stencil_j, stencil_k;
-                int t = 0;
 
-                for (stencil_j = -size; stencil_j <= size; stencil_j++) {
-                    for (stencil_k = -size; stencil_k <= size; stencil_k++) {
-                        t += image[i * width * height + CONV(j + stencil_j, k + stencil_k, width)];
-                    }
+            /*
+             * After a sweep the other buffer is several iterations old, so
+             * row tracking has to start over from a full iteration.
+             */
+            if (first_end >= 0 && first_end < wf.steps - 1) {
+                /* Converged inside the sweep: replay it one step at a time */
+                for (b = 0; b < 2; b++) {
+                    blur_band_mark_moved(&bands[b], cur, size);
                 }
+                use_wavefront = 0;
+                end = 0;
+                continue;
+            }
+            for (b = 0; b < 2; b++) {
+                blur_band_mark_moved(&bands[b], 1 - cur, size);
+            }
+            cur = 1 - cur;
+            end = first_end >= 0;
 
-                new_image[CONV(j, k, width)] = t / ((2 * size + 1) * (2 * size + 1));
+            /* Row tracking is cheaper once most rows have settled */
+            if (2 * moved_rows < total_rows) {
+                use_wavefront = 0;
             }
         }
-
-        /* Copy the middle part of the image */
-        for (j = height / 10 - size; j < height * 0.9 + size; j++) {
-            for (k = size; k < width - size; k++) {
-                new_image[CONV(j, k, width)] = image[i * width * height + CONV(j, k, width)];
+        else {
+            end = 1;
+            for (b = 0; b < 2; b++) {
+                if (bands[b].begin >= bands[b].end) {
+                    continue;
+                }
+                #pragma omp parallel for num_threads(n_threads) reduction(&:end)
+                for (t = 0; t < n_threads; t++) {
+                    int j_begin, j_end;
+                    blur_work work;
+
+                    work.colsum = colsums + (long)t * layout->cols;
+                    work.scratch = scratch + t * (width + 1L);
+                    blur_band_block(&bands[b], size, t, n_threads, &j_begin, &j_end);
+                    end &= blur_band_iterate(&bp, &bands[b], cur, &work, j_begin, j_end);
+                }
             }
+            cur = 1 - cur;
         }
+    } while (threshold > 0 && !end);
+
+    blur_wavefront_free(&wf);
+    free(colsums);
+    free(scratch);
+    return cur;
+}
 
-        /* Apply blur on the bottom part of the image (10%) */
-        for (j = height * 0.9 + size; j < height - size; j++) {
-            for (k = size; k < width - size; k++) {
-                int stencil_j, stencil_k;
-                int t = 0;
+/* Offset of pixel (l, c) in rows of nb_c, computed in 64 bits */
+#define CONV(l, c, nb_c) \
+    ((long long int)(l) * (nb_c) + (c))
 
-                for (stencil_j = -size; stencil_j <= size; stencil_j++) {
-                    for (stencil_k = -size; stencil_k <= size; stencil_k++) {
-                        t += image[i * width * height + CONV(j + stencil_j, k + stencil_k, width)];
-                    }
-                }
 
-                new_image[CONV(j, k, width)] = t / ((2 * size + 1) * (2 * size + 1));
+/*
+ * Rows the Sobel reads: those of the frame, except blurred rows the blur
+ * left in the private copy of their band (bands is NULL if it did not).
+ */
+typedef struct sobel_source {
+    const unsigned char* image;
+    const blur_band* bands;
+    int size;
+    const frame_layout* layout;
+} sobel_source;
+
+static const unsigned char* sobel_source_row(const sobel_source* src, int j)
+{
+    int b;
+
+    if (src->bands != NULL) {
+        for (b = 0; b < 2; b++) {
+            const blur_band* band = &src->bands[b];
+
+            if (j >= band->begin && j < band->end) {
+                return band->buf[1] + CONV(j - band->begin + src->size, 0, src->layout->stride);
             }
         }
+    }
+    return src->image + CONV(j, 0, src->layout->stride);
+}
 
-        for (j = 1; j < height - 1; j++) {
-            for (k = 1; k < width - 1; k++) {
-                float diff = new_image[CONV(j, k, width)] - image[i * width * height + CONV(j, k, width)];
-                if (diff > threshold || -diff > threshold) {
-                    end = 0;
-                }
-                image[i * width * height + CONV(j, k, width)] = new_image[CONV(j, k, width)];
-            }
+/*
+ * Rows [begin, end) that the Sobel overwrites in place. The blocks around
+ * it may overwrite rows begin - 1 and end first, so above and below hold
+ * a copy of these two rows, taken by sobel_save_edges. Copies of rows
+ * (edges and rings) are whole padded rows, stride bytes apart, pointing
+ * at their pixel 0.
+ */
+typedef struct sobel_block {
+    int begin;
+    int end;
+    unsigned char* above;
+    unsigned char* below;
+} sobel_block;
+
+/*
+ * Append [begin, end) split in at most n blocks, with their edge rows
+ * taken from *edges. Returns the number of blocks added.
+ */
+static int sobel_split(sobel_block* blocks, int begin, int end, int n, unsigned char** edges,
+    const frame_layout* layout)
+{
+    int i;
+    int n_blocks = 0;
+
+    for (i = 0; i < n; i++) {
+        int block_begin = begin + (int)((long)(end - begin) * i / n);
+        int block_end = begin + (int)((long)(end - begin) * (i + 1) / n);
+
+        if (block_begin >= block_end) {
+            continue;
         }
-    } while (threshold > 0 && !end);
+        blocks[n_blocks].begin = block_begin;
+        blocks[n_blocks].end = block_end;
+        blocks[n_blocks].above = *edges + layout->pad;
+        blocks[n_blocks].below = *edges + layout->stride + layout->pad;
+        *edges += 2 * layout->stride;
+        n_blocks++;
+    }
+    return n_blocks;
+}
+
+/* Copy the edge rows of the blocks that lie in rows [lo, hi) */
+static void sobel_save_edges(const sobel_source* src, sobel_block* blocks, int n_blocks,
+    int lo, int hi, int n_threads)
+{
+    int pad = src->layout->pad;
+    int i;
+
+    #pragma omp parallel for num_threads(n_threads)
+    for (i = 0; i < n_blocks; i++) {
+        int above = blocks[i].begin - 1;
+        int below = blocks[i].end;
 
-    free(new_image);
+        if (above >= lo && above < hi) {
+            memcpy(blocks[i].above - pad, sobel_source_row(src, above) - pad,
+                src->layout->stride);
+        }
+        if (below >= lo && below < hi) {
+            memcpy(blocks[i].below - pad, sobel_source_row(src, below) - pad,
+                src->layout->stride);
+        }
+    }
 }
 
+/*
+ * Sobel of a block, written over its rows of image. Before a row is
+ * overwritten its input is copied to ring (two rows), since the next row
+ * still reads it: only the previous input row has to be kept around.
+ */
+static void sobel_block_in_place(const sobel_source* src, unsigned char* image, const sobel_block* block,
+    unsigned char* ring)
+{
+    const sobel_kernels* kernels = sobel_kernels_select();
+    const frame_layout* layout = src->layout;
+    const unsigned char* above = block->above;
+    int j;
 
+    for (j = block->begin; j < block->end; j++) {
+        const unsigned char* row = sobel_source_row(src, j);
+        const unsigned char* below = j + 1 < block->end ? sobel_source_row(src, j + 1) : block->below;
+        unsigned char* out = image + CONV(j, 0, layout->stride);
 
-#define CONV(l, c, nb_c) \
-    (l) * (nb_c) + (c)
+        if (row == out) {
+            unsigned char* copy = ring + CONV(j & 1, 0, layout->stride);
 
+            memcpy(copy - layout->pad, row - layout->pad, layout->stride);
+            row = copy;
+        }
+        kernels->row(above, row, below, out, layout->width);
+        above = row;
+    }
+}
 
-void apply_sobel_filter_flattened_array(int* image, int width, int height)
+/* Two-row ring of thread t in rings */
+static unsigned char* sobel_ring(unsigned char* rings, const frame_layout* layout, int t)
 {
-    int i, j, k;
+    return rings + CONV(2 * t, 0, layout->stride) + layout->pad;
+}
 
-    int* sobel = (int*)malloc(width * height * sizeof(int));
-    for (j = 1; j < height - 1; j++) {
-        for (k = 1; k < width - 1; k++) {
-            int pixel_no, pixel_n, pixel_ne;
-            int pixel_so, pixel_s, pixel_se;
-            int pixel_o, pixel_e;
+/* Sobel of the blocks, thread t using rows 2t and 2t + 1 of rings */
+static void sobel_blocks(const sobel_source* src, unsigned char* image, const sobel_block* blocks,
+    int n_blocks, unsigned char* rings, int n_threads)
+{
+    int i;
 
-            float deltaX;
-            float deltaY;
-            float val;
+    #pragma omp parallel for num_threads(n_threads)
+    for (i = 0; i < n_blocks; i++) {
+        sobel_block_in_place(src, image, &blocks[i],
+            sobel_ring(rings, src->layout, omp_get_thread_num()));
+    }
+}
 
-            pixel_no = image[CONV(j - 1, k - 1, width)];
-            pixel_n = image[CONV(j - 1, k, width)];
-            pixel_ne = image[CONV(j - 1, k + 1, width)];
-            pixel_so = image[CONV(j + 1, k - 1, width)];
-            pixel_s = image[CONV(j + 1, k, width)];
-            pixel_se = image[CONV(j + 1, k + 1, width)];
-            pixel_o = image[CONV(j, k - 1, width)];
-            pixel_e = image[CONV(j, k + 1, width)];
+/* Rows of the middle of the frame handed out at a time */
+#define SOBEL_CHUNK_ROWS 64
+
+/*
+ * Sobel of blocks *next and above, taken one by one by whichever thread
+ * is free until none are left. Thread t uses rows 2t and 2t + 1 of rings.
+ */
+static void sobel_blocks_shared(const sobel_source* src, unsigned char* image, const sobel_block* blocks,
+    int n_blocks, int* next, unsigned char* rings, int n_threads)
+{
+    #pragma omp parallel num_threads(n_threads)
+    for (;;) {
+        int i;
+
+        #pragma omp atomic capture
+        i = (*next)++;
+        if (i >= n_blocks) {
+            break;
+        }
+        sobel_block_in_place(src, image, &blocks[i],
+            sobel_ring(rings, src->layout, omp_get_thread_num()));
+    }
+}
 
-            deltaX = -pixel_no + pixel_ne - 2 * pixel_o + 2 * pixel_e - pixel_so + pixel_se;
-            deltaY = pixel_se + 2 * pixel_s + pixel_so - pixel_ne - 2 * pixel_n - pixel_no;
+/*
+ * Blur then Sobel, as one stage working in place.
+ *
+ * Sobel row j only reads rows j - 1 to j + 1, so the middle of the frame,
+ * away from the blurred bands and from the rows the blur reads around
+ * them, has its final input from the start: it is done while the blur
+ * iterates. The blur keeps all threads but one and, once it has
+ * converged, its threads join what is left of the middle.
+ *
+ * The rows around the bands come last and read the blurred rows from
+ * wherever the last blur iteration wrote them, so a band is never copied
+ * back into the frame before being overwritten. Every row is overwritten
+ * by its Sobel output, keeping only the previous input row in a two-row
+ * ring per thread and the edge rows of each block; there is no second
+ * frame-sized buffer. The output is the one of the two filters run one
+ * after the other.
+ *
+ * Returns 0 if the frame could not be filtered (its content is then
+ * undefined).
+ */
+int apply_blur_and_sobel_flattened_array(unsigned char* frame, int size, int threshold,
+    const frame_layout* layout, int n_threads)
+{
+    unsigned char* image = frame + layout->origin;
+    int height = layout->height;
+    blur_band bands[2];
+    sobel_source src;
+    sobel_block* blocks;
+    unsigned char* edges;
+    unsigned char* next_edges;
+    unsigned char* rings;
+    int n_middle, n_blocks;
+    int next = 0;
+    int begin, end;
+    int middle_begin = 1;
+    int middle_end = height - 1;
+    int cur, i;
+
+    blur_band_rows(0, size, height, &begin, &end);
+    if (begin < end) {
+        middle_begin = end + size;
+    }
+    blur_band_rows(1, size, height, &begin, &end);
+    if (begin < end) {
+        middle_end = begin - size;
+    }
+    if (n_threads < 2 || middle_begin >= middle_end) {
+        /* Nothing to overlap with: everything waits for the blur */
+        middle_begin = 1;
+        middle_end = 1;
+    }
 
-            val = sqrt(deltaX * deltaX + deltaY * deltaY) / 4;
+    n_middle = (middle_end - middle_begin + SOBEL_CHUNK_ROWS - 1) / SOBEL_CHUNK_ROWS;
+    blocks = (sobel_block*)malloc((n_middle + 2 * n_threads) * sizeof(sobel_block));
+    edges = (unsigned char*)malloc(2L * (n_middle + 2 * n_threads) * layout->stride);
+    rings = (unsigned char*)malloc(2L * n_threads * layout->stride);
+    if (blocks == NULL || edges == NULL || rings == NULL) {
+        fprintf(stderr, "Unable to allocate Sobel work of %d threads\n", n_threads);
+        free(rings);
+        free(edges);
+        free(blocks);
+        return 0;
+    }
 
-            if (val > 50) {
-                sobel[CONV(j, k, width)] = 255;
-            }
-            else {
-                sobel[CONV(j, k, width)] = 0;
+    next_edges = edges;
+    n_blocks = sobel_split(blocks, middle_begin, middle_end, n_middle, &next_edges, layout);
+    n_blocks += sobel_split(blocks + n_blocks, 1, middle_begin, n_threads, &next_edges, layout);
+    n_blocks += sobel_split(blocks + n_blocks, middle_end, height - 1, n_threads, &next_edges,
+        layout);
+
+    /*
+     * The middle and the rows around it do not change during the blur:
+     * save every edge that lies there before the middle gets overwritten.
+     */
+    src.image = image;
+    src.bands = NULL;
+    src.size = size;
+    src.layout = layout;
+    sobel_save_edges(&src, blocks, n_middle, 0, height, n_threads);
+    sobel_save_edges(&src, blocks + n_middle, n_blocks - n_middle, middle_begin, middle_end,
+        n_threads);
+
+    if (n_middle > 0) {
+        /* The blur runs its own parallel loops inside its section */
+        int max_levels = omp_get_max_active_levels();
+
+        omp_set_max_active_levels(2);
+        #pragma omp parallel sections num_threads(2)
+        {
+            #pragma omp section
+            {
+                cur = blur_frame(image, size, threshold, layout, n_threads - 1, bands);
+                sobel_blocks_shared(&src, image, blocks, n_middle, &next, rings,
+                    n_threads - 1);
             }
+            #pragma omp section
+            sobel_blocks_shared(&src, image, blocks, n_middle, &next,
+                rings + CONV(2 * (n_threads - 1), 0, layout->stride), 1);
         }
+        omp_set_max_active_levels(max_levels);
+    }
+    else {
+        cur = blur_frame(image, size, threshold, layout, n_threads, bands);
+    }
+    if (cur < 0) {
+        free(rings);
+        free(edges);
+        free(blocks);
+        return 0;
     }
 
-    for (j = 1; j < height - 1; j++) {
-        for (k = 1; k < width - 1; k++) {
-            image[CONV(j, k, width)] = sobel[CONV(j, k, width)];
-        }
+    if (cur == 1) {
+        src.bands = bands;
     }
-    free(sobel);
+    sobel_save_edges(&src, blocks + n_middle, n_blocks - n_middle, 0, middle_begin,
+        n_threads);
+    sobel_save_edges(&src, blocks + n_middle, n_blocks - n_middle, middle_end, height,
+        n_threads);
+
+    sobel_blocks(&src, image, blocks + n_middle, n_blocks - n_middle, rings, n_threads);
+
+    for (i = 0; i < 2; i++) {
+        blur_band_free(&bands[i]);
+    }
+    free(rings);
+    free(edges);
+    free(blocks);
+    return 1;
 }
 
-int* gif_to_flatten_array(const animated_gif* image, int num_images)
+/*
+ * Gray levels of the frames, one after the other, each laid out as
+ * frame_layout_init gives for FRAME_HALO (offsets from get_image_offsets).
+ */
+unsigned char* gif_to_flatten_array(const animated_gif* image, int num_images)
 {
+    frame_layout layout;
+    long long int nb_bytes = 0;
+    for (int i = 0; i < num_images; i++) {
+        frame_layout_init(&layout, image->width[i], image->height[i], FRAME_HALO);
+        nb_bytes += layout.bytes;
+    }
+    long long int offset = 0;
+    unsigned char* array = frame_alloc(nb_bytes);
+    unsigned char lut[256];
 
-    int nb_pixels = 0;
-    for (int i = 0; i < image->n_images; i++) {
-        nb_pixels += image->width[i] * image->height[i];
+    if (array == NULL) {
+        return NULL;
+    }
+    if (image->p == NULL) {
+        /* Paletted frames not expanded: one lookup per color index */
+        gray_lut(image->g->SColorMap, lut);
     }
-    int idx = 0;
-    int* array = malloc(nb_pixels * sizeof(int));
     for (int i = 0; i < num_images; i++) {
-        for (int j = 0; j < image->height[i]; j++) {
-            for (int k = 0; k < image->width[i]; k++) {
-                int moy;
-                pixel** p = image->p;
-                moy = (p[i][CONV(j, k, image->width[i])].r + p[i][CONV(j, k, image->width[i])].g + p[i][CONV(j, k, image->width[i])].b) / 3;
-                if (moy < 0)
-                    moy = 0;
-                if (moy > 255)
-                    moy = 255;
-                array[idx++] = moy;
+        int width = image->width[i];
+        unsigned char* frame = array + offset;
+
+        frame_layout_init(&layout, width, image->height[i], FRAME_HALO);
+        for (int j = 0; j < layout.height; j++) {
+            unsigned char* row = frame + layout.origin + CONV(j, 0, layout.stride);
+            long long int first = CONV(j, 0, width);
+
+            if (image->p == NULL) {
+                const GifByteType* raster = image->g->SavedImages[i].RasterBits + first;
+
+                for (int k = 0; k < width; k++) {
+                    row[k] = lut[raster[k]];
+                }
+                continue;
             }
+
+            /* Expanded pixels are gray */
+            memcpy(row, image->p[i].r + first, width);
         }
+        frame_fill_halo(frame, &layout);
+        offset += layout.bytes;
     }
 
     return array;
@@ -590,9 +1639,66 @@ int get_first_image_of_rank(int rank, int n_images, int size) {
     return current_image;
 }
 
+/*
+ * MPI 3.1 counts are int, so a transfer of more than MPI_TRANSFER_CHUNK
+ * bytes goes out as several messages. Both sides cut it the same way.
+ */
+#ifndef MPI_TRANSFER_CHUNK
+#define MPI_TRANSFER_CHUNK (1 << 30)
+#endif
+
+static void mpi_send_bytes(const unsigned char* buffer, long long int bytes, int dest, int tag)
+{
+    long long int done;
+
+    for (done = 0; done < bytes; done += MPI_TRANSFER_CHUNK) {
+        int count = bytes - done < MPI_TRANSFER_CHUNK ? (int)(bytes - done) : MPI_TRANSFER_CHUNK;
+
+        MPI_Send(buffer + done, count, MPI_BYTE, dest, tag, MPI_COMM_WORLD);
+    }
+}
+
+static void mpi_recv_bytes(unsigned char* buffer, long long int bytes, int source, int tag)
+{
+    long long int done;
+
+    for (done = 0; done < bytes; done += MPI_TRANSFER_CHUNK) {
+        int count = bytes - done < MPI_TRANSFER_CHUNK ? (int)(bytes - done) : MPI_TRANSFER_CHUNK;
+
+        MPI_Recv(buffer + done, count, MPI_BYTE, source, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+/* Byte offsets of the padded frames (see frame_layout.h), all aligned */
 long long int* get_image_offsets(int* widths, int* heights, int n_images) {
     long long int* offsets = malloc((n_images + 1) * sizeof(long long int));
     long long int current_offset = 0;
+
+    if (offsets == NULL) {
+        fprintf(stderr, "Unable to allocate offsets of %d images\n", n_images);
+        return NULL;
+    }
+    for (int i = 0; i < n_images; i++) {
+        frame_layout layout;
+
+        frame_layout_init(&layout, widths[i], heights[i], FRAME_HALO);
+        offsets[i] = current_offset;
+        current_offset += layout.bytes;
+    }
+    offsets[n_images] = current_offset;
+
+    return offsets;
+}
+
+/* Byte offsets of the frames packed as width * height pixels, for MPI */
+long long int* get_pixel_offsets(int* widths, int* heights, int n_images) {
+    long long int* offsets = malloc((n_images + 1) * sizeof(long long int));
+    long long int current_offset = 0;
+
+    if (offsets == NULL) {
+        fprintf(stderr, "Unable to allocate offsets of %d images\n", n_images);
+        return NULL;
+    }
     for (int i = 0; i < n_images; i++) {
         offsets[i] = current_offset;
         current_offset += (long long int)widths[i] * heights[i];
@@ -602,31 +1708,135 @@ long long int* get_image_offsets(int* widths, int* heights, int n_images) {
     return offsets;
 }
 
-void process_one_image(int* buffer, int width, int height, int use_cuda, int use_omp) {
+/*
+ * The Sobel output of a frame is 0 or 255 except for the border it
+ * preserves, so it travels as an edge mask: one bit per pixel in row-major
+ * order (set for 255, 0 on the border), followed by the border pixels, one
+ * byte each in row-major order.
+ */
+static int edge_mask_is_border(int j, int k, int width, int height)
+{
+    return j == 0 || j == height - 1 || k == 0 || k == width - 1;
+}
+
+long long int edge_mask_bytes(int width, int height)
+{
+    long long int pixels = (long long int)width * height;
+    long long int interior = 0;
+
+    if (width > 2 && height > 2) {
+        interior = (long long int)(width - 2) * (height - 2);
+    }
+    return (pixels + 7) / 8 + pixels - interior;
+}
+
+long long int* get_mask_offsets(int* widths, int* heights, int n_images) {
+    long long int* offsets = malloc((n_images + 1) * sizeof(long long int));
+    long long int current_offset = 0;
+
+    if (offsets == NULL) {
+        fprintf(stderr, "Unable to allocate offsets of %d images\n", n_images);
+        return NULL;
+    }
+    for (int i = 0; i < n_images; i++) {
+        offsets[i] = current_offset;
+        current_offset += edge_mask_bytes(widths[i], heights[i]);
+    }
+    offsets[n_images] = current_offset;
+
+    return offsets;
+}
+
+void edge_mask_pack(const unsigned char* frame, const frame_layout* layout, unsigned char* mask)
+{
+    int width = layout->width;
+    int height = layout->height;
+    long long int pixels = (long long int)width * height;
+    unsigned char* border = mask + (pixels + 7) / 8;
+    int j, k;
+
+    memset(mask, 0, (pixels + 7) / 8);
+    for (j = 0; j < height; j++) {
+        const unsigned char* row = frame + layout->origin + CONV(j, 0, layout->stride);
+        long long int bit = CONV(j, 0, width);
+
+        if (j == 0 || j == height - 1) {
+            for (k = 0; k < width; k++) {
+                *border++ = row[k];
+            }
+            continue;
+        }
+        *border++ = row[0];
+        for (k = 1; k < width - 1; k++) {
+            if (row[k]) {
+                mask[(bit + k) >> 3] |= 1 << ((bit + k) & 7);
+            }
+        }
+        if (width > 1) {
+            *border++ = row[width - 1];
+        }
+    }
+}
+
+/* Returns 0 if the frame could not be filtered */
+int process_one_image(unsigned char* buffer, const frame_layout* layout, int radius, int use_cuda, int use_omp) {
+    /* Threads inside the frame, unless frames are already spread over them */
+    int n_threads = use_omp && !omp_in_parallel() ? omp_get_max_threads() : 1;
+
     if (use_cuda) {
-            apply_blur_filter_cuda(buffer, 20, 5, width, height);
-            apply_sobel_filter_cuda(buffer, width, height);
+            apply_blur_filter_cuda(buffer + layout->origin, 20, radius, layout->width, layout->height,
+                layout->stride);
+            apply_sobel_filter_cuda(buffer + layout->origin, layout->width, layout->height,
+                layout->stride);
+            return 1;
         }
         else {
-            apply_blur_filter_flattened_array(buffer, 5, 20, width, height);
-            apply_sobel_filter_flattened_array(buffer, width, height);
+            return apply_blur_and_sobel_flattened_array(buffer, radius, 20, layout, n_threads);
         }
 }
 
-void process_images(int* buffer, int n_images, int* widths, int* heights, int use_cuda, int use_omp) {
+/*
+ * Filter n_images frames of buffer and store their edge masks in masks,
+ * one after the other (offsets from get_mask_offsets). Returns 0 if any
+ * frame could not be filtered.
+ */
+int process_images(unsigned char* buffer, int n_images, int* widths, int* heights, int radius, int use_cuda, int use_omp,
+    unsigned char* masks) {
     long long int* offsets = get_image_offsets(widths, heights, n_images);
+    long long int* mask_offsets = get_mask_offsets(widths, heights, n_images);
+    int ok = 1;
+
+    if (offsets == NULL || mask_offsets == NULL) {
+        free(mask_offsets);
+        free(offsets);
+        return 0;
+    }
 
-    if(use_omp) {
-         #pragma omp parallel for
+    /*
+     * One frame per thread keeps every thread busy only with enough frames.
+     * With fewer (a still image, a short clip) frames go one at a time and
+     * the threads share the rows of each frame instead.
+     */
+    if(use_omp && n_images >= omp_get_max_threads()) {
+         #pragma omp parallel for reduction(&:ok)
         for (int i = 0; i < n_images; i++) {
-            process_one_image(buffer+offsets[i], widths[i], heights[i], use_cuda, use_omp);
+            frame_layout layout;
+            frame_layout_init(&layout, widths[i], heights[i], FRAME_HALO);
+            ok &= process_one_image(buffer+offsets[i], &layout, radius, use_cuda, use_omp);
+            edge_mask_pack(buffer + offsets[i], &layout, masks + mask_offsets[i]);
         }
     }
     else{ 
         for (int i = 0; i < n_images; i++) {
-            process_one_image(buffer+offsets[i], widths[i], heights[i], use_cuda, use_omp);
+            frame_layout layout;
+            frame_layout_init(&layout, widths[i], heights[i], FRAME_HALO);
+            ok &= process_one_image(buffer+offsets[i], &layout, radius, use_cuda, use_omp);
+            edge_mask_pack(buffer + offsets[i], &layout, masks + mask_offsets[i]);
         }
     }
+    free(mask_offsets);
+    free(offsets);
+    return ok;
 }
 
 int get_number_images_to_rank(int rank, int n_images, int size) {
@@ -635,18 +1845,48 @@ int get_number_images_to_rank(int rank, int n_images, int size) {
     return images_per_rank + (remainder_images >= rank ? 1 : 0);
 }
 
-void flattened_matrix_to_gif(animated_gif* image, int* flattened_matrix) {
-    int idx = 0;
+/*
+ * Write the edge masks of every frame (from process_images) into image,
+ * and list the gray levels written for store_pixels. Returns 0 if the
+ * gray planes could not be allocated.
+ */
+int edge_masks_to_gif(animated_gif* image, const unsigned char* masks) {
+    unsigned char seen[256] = { 0 };
+
+    /* The result is gray: one plane per image is enough */
+    if (image->p == NULL) {
+        if (!animated_gif_alloc_gray(image)) {
+            return 0;
+        }
+    }
+    image->n_values = 0;
     for (int i = 0; i < image->n_images; i++) {
-        for (int j = 0; j < image->height[i]; j++) {
-            for (int k = 0; k < image->width[i]; k++) {
-                image->p[i][CONV(j, k, image->width[i])].r = flattened_matrix[idx];
-                image->p[i][CONV(j, k, image->width[i])].g = flattened_matrix[idx];
-                image->p[i][CONV(j, k, image->width[i])].b = flattened_matrix[idx];
-                idx++;
+        int width = image->width[i];
+        int height = image->height[i];
+        long long int pixels = (long long int)width * height;
+        const unsigned char* border = masks + (pixels + 7) / 8;
+
+        for (int j = 0; j < height; j++) {
+            for (int k = 0; k < width; k++) {
+                long long int bit = CONV(j, k, width);
+                int value;
+
+                if (edge_mask_is_border(j, k, width, height)) {
+                    value = *border++;
+                }
+                else {
+                    value = masks[bit >> 3] & (1 << (bit & 7)) ? 255 : 0;
+                }
+                image->p[i].r[bit] = value;
+                if (!seen[value]) {
+                    seen[value] = 1;
+                    image->values[image->n_values++] = value;
+                }
             }
         }
+        masks += edge_mask_bytes(width, height);
     }
+    return 1;
 }
 
 void export_file(char* output_filename, animated_gif* image) {
@@ -674,7 +1914,7 @@ animated_gif* create_dumb_image(int n_images, int width, int height) {
     image->n_images = n_images;
     image->width = malloc(n_images * sizeof(int));
     image->height = malloc(n_images * sizeof(int));
-    image->p = malloc(n_images * sizeof(pixel*));
+    image->p = malloc(n_images * sizeof(pixel_planes));
     if (image->width == NULL || image->height == NULL || image->p == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         free(image->width);
@@ -688,12 +1928,10 @@ animated_gif* create_dumb_image(int n_images, int width, int height) {
         image->width[i] = width;
         image->height[i] = height;
 
-        image->p[i] = malloc(width * height * sizeof(pixel));
-
-        if (image->p[i] == NULL) {
+        if (!pixel_planes_alloc(&image->p[i], (long long int)width * height)) {
             fprintf(stderr, "Memory allocation failed\n");
             for (int j = 0; j < i; j++) {
-                free(image->p[j]);
+                pixel_planes_free(&image->p[j]);
             }
             free(image->width);
             free(image->height);
@@ -701,12 +1939,16 @@ animated_gif* create_dumb_image(int n_images, int width, int height) {
             free(image);
             return NULL;
         }
-        for (int j = 0; j < width * height; j++) {
-            image->p[i][j].r = rand() % 256;
-            image->p[i][j].g = rand() % 256;
-            image->p[i][j].b = rand() % 256;
+        /* Random colors, only their gray level is kept */
+        for (long long int j = 0; j < (long long int)width * height; j++) {
+            int r = rand() % 256;
+            int g = rand() % 256;
+            int b = rand() % 256;
+
+            image->p[i].r[j] = gray_level(r, g, b);
         }
     }
+    image->n_values = -1;
 
     return image;
 }
@@ -720,6 +1962,10 @@ animated_gif* load_image(int has_file, char* input_filename, int n_images, int w
         image = create_dumb_image(n_images, width, height);
     }
     else {
+        /*
+         * Only gray levels are filtered, and gif_to_flatten_array gets them
+         * from the color indices: no need to expand the pixels.
+         */
         image = load_pixels(input_filename);
         if (image == NULL) {
             return NULL;
@@ -737,8 +1983,9 @@ void scheduler(int* use_mpi, int* use_omp, int*use_cuda, int benchmark, int n_im
         return;
     }
     if(n_images < 5) {
+        /* Few frames: threads still share the rows of each frame */
         *use_mpi = 0;
-        *use_omp = 0;
+        *use_omp = 1;
         *use_cuda = 0;
     }
     else if(is_cuda_available()) {
@@ -751,7 +1998,7 @@ void scheduler(int* use_mpi, int* use_omp, int*use_cuda, int benchmark, int n_im
     printf("Running with:\nMPI: %d\nOpenMP: %d\nCUDA: %d\n", *use_mpi, *use_omp, *use_cuda);
 }
 
-int run(int argc, char** argv, int n_images, int width, int height, int N, char* input_filename, char* output_filename, int benchmark, int has_file, int use_mpi, int use_omp, int use_cuda) {
+int run(int argc, char** argv, int n_images, int width, int height, int N, char* input_filename, char* output_filename, int benchmark, int has_file, int radius, int use_mpi, int use_omp, int use_cuda) {
     animated_gif* image = NULL;
     int* widths;
     int* heights;
@@ -761,11 +2008,16 @@ int run(int argc, char** argv, int n_images, int width, int height, int N, char*
     double duration, duration2;
     int root_process = 0;
     int rank, size;
-    int* flattened_gif_matrix;
+    unsigned char* flattened_gif_matrix = NULL;
+    unsigned char* masks = NULL;
+    int ok = 1;
 
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
+    /* Pick the kernels for this CPU before any thread needs them */
+    blur_kernels_select();
+    sobel_kernels_select();
     if (rank == root_process) {
         image = load_image(has_file, input_filename, n_images, width, height);
         n_images = image->n_images;
@@ -775,64 +2027,168 @@ int run(int argc, char** argv, int n_images, int width, int height, int N, char*
         scheduler(&use_mpi, &use_omp, &use_cuda, benchmark, n_images);
         gettimeofday(&t1, NULL);
         flattened_gif_matrix = gif_to_flatten_array(image, image->n_images);
+        long long int* mask_offsets = get_mask_offsets(image->width, image->height, n_images);
+        if (mask_offsets != NULL) {
+            masks = (unsigned char*)malloc(mask_offsets[n_images] > 0 ? mask_offsets[n_images] : 1);
+            if (masks == NULL) {
+                fprintf(stderr, "Unable to allocate %lld bytes of edge masks\n", mask_offsets[n_images]);
+            }
+        }
+        free(mask_offsets);
+        ok = flattened_gif_matrix != NULL && masks != NULL;
         if (!use_mpi || size ==1) {
             if(size == 1) {
                 printf("Only one process, sequential approach will be chosen \n");
             }
-            process_images(flattened_gif_matrix, n_images, image->width, image->height, use_cuda, use_omp);
+            if (ok) {
+                ok = process_images(flattened_gif_matrix, n_images, image->width, image->height, radius, use_cuda,
+                    use_omp, masks);
+            }
         }
     }
     if (use_mpi && size>1) {
         MPI_Bcast(&n_images, 1, MPI_INT, root_process, MPI_COMM_WORLD);
-        widths = malloc(n_images * sizeof(int));
-        heights = malloc(n_images * sizeof(int));
         if (rank == root_process) {
             widths = image->width;
             heights = image->height;
         }
+        else {
+            widths = malloc(n_images * sizeof(int));
+            heights = malloc(n_images * sizeof(int));
+            if (widths == NULL || heights == NULL) {
+                /* Without them this rank cannot even take part in the broadcasts */
+                fprintf(stderr, "Unable to allocate sizes of %d images\n", n_images);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
         MPI_Bcast(widths, n_images, MPI_INT, root_process, MPI_COMM_WORLD);
         MPI_Bcast(heights, n_images, MPI_INT, root_process, MPI_COMM_WORLD);
         long long int* offsets = get_image_offsets(widths, heights, n_images);
+        long long int* pixel_offsets = get_pixel_offsets(widths, heights, n_images);
+        long long int* mask_offsets = get_mask_offsets(widths, heights, n_images);
+        int nb_images_local = rank == root_process ? 0 : get_number_images_to_rank(rank, n_images, size);
+        int first_image = nb_images_local > 0 ? get_first_image_of_rank(rank, n_images, size) : 0;
+        unsigned char* pixels = NULL;
+        unsigned char* buffer = NULL;
+        unsigned char* local_masks = NULL;
+
+        if (offsets == NULL || pixel_offsets == NULL || mask_offsets == NULL) {
+            ok = 0;
+        }
+        else if (rank == root_process) {
+            /* One staging buffer for the frames of every rank in turn */
+            long long int max_pixels = 1;
+            for (int i = 1; i < size; i++) {
+                int nb_images = get_number_images_to_rank(i, n_images, size);
+                if (nb_images == 0) {
+                    break;
+                }
+                int current_image = get_first_image_of_rank(i, n_images, size);
+                long long int nb_pixels = pixel_offsets[current_image + nb_images] - pixel_offsets[current_image];
+                if (nb_pixels > max_pixels) {
+                    max_pixels = nb_pixels;
+                }
+            }
+            pixels = (unsigned char*)malloc(max_pixels);
+            if (pixels == NULL) {
+                fprintf(stderr, "Unable to allocate %lld bytes of frames to send\n", max_pixels);
+                ok = 0;
+            }
+        }
+        else if (nb_images_local > 0) {
+            long long int nb_bytes = offsets[first_image + nb_images_local] - offsets[first_image];
+            long long int nb_pixels = pixel_offsets[first_image + nb_images_local] - pixel_offsets[first_image];
+            long long int nb_mask_bytes = mask_offsets[first_image + nb_images_local] - mask_offsets[first_image];
+            buffer = frame_alloc(nb_bytes);
+            pixels = (unsigned char*)malloc(nb_pixels > 0 ? nb_pixels : 1);
+            local_masks = (unsigned char*)malloc(nb_mask_bytes > 0 ? nb_mask_bytes : 1);
+            if (pixels == NULL || local_masks == NULL) {
+                fprintf(stderr, "Unable to allocate %lld bytes of frames and %lld bytes of edge masks\n",
+                    nb_pixels, nb_mask_bytes);
+            }
+            ok = buffer != NULL && pixels != NULL && local_masks != NULL;
+        }
 
-        if (rank == root_process) {
-            int count = 0;
+        /*
+         * Every rank needs its buffers before a single frame moves: if one
+         * of them is missing, nobody sends anything and the run fails below.
+         */
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+        /*
+         * Frames go out packed, without their padding, and come back as edge
+         * masks. Each side lays them out or packs them on its own.
+         */
+        if (ok && rank == root_process) {
             for (int i = 1; i < size; i++) {
                 int nb_images = get_number_images_to_rank(i, n_images, size);
                 if (nb_images == 0) {
                     break;
                 }
                 int current_image = get_first_image_of_rank(i, n_images, size);
-                int nb_pixels = offsets[current_image + nb_images] - offsets[current_image];
-                MPI_Sendrecv(flattened_gif_matrix + offsets[current_image], nb_pixels, MPI_INT, i, 0,
-                    flattened_gif_matrix + offsets[current_image], nb_pixels, MPI_INT, i, 0,
-                    MPI_COMM_WORLD, NULL);
+                long long int nb_pixels = pixel_offsets[current_image + nb_images] - pixel_offsets[current_image];
+                long long int nb_mask_bytes = mask_offsets[current_image + nb_images] - mask_offsets[current_image];
+
+                for (int j = current_image; j < current_image + nb_images; j++) {
+                    frame_layout layout;
+
+                    frame_layout_init(&layout, widths[j], heights[j], FRAME_HALO);
+                    frame_pack(flattened_gif_matrix + offsets[j], &layout,
+                        pixels + pixel_offsets[j] - pixel_offsets[current_image]);
+                }
+                mpi_send_bytes(pixels, nb_pixels, i, 0);
+                mpi_recv_bytes(masks + mask_offsets[current_image], nb_mask_bytes, i, 0);
             }
         }
-        else {
-            int nb_images_local = get_number_images_to_rank(rank, n_images, size);
-            if (nb_images_local == 0) {
-                free(image_information);
-                free(offsets);
-                MPI_Finalize();
-                return 0;
+        else if (ok && nb_images_local > 0) {
+            long long int nb_pixels = pixel_offsets[first_image + nb_images_local] - pixel_offsets[first_image];
+            long long int nb_mask_bytes = mask_offsets[first_image + nb_images_local] - mask_offsets[first_image];
+            mpi_recv_bytes(pixels, nb_pixels, root_process, 0);
+            for (int j = first_image; j < first_image + nb_images_local; j++) {
+                frame_layout layout;
+
+                frame_layout_init(&layout, widths[j], heights[j], FRAME_HALO);
+                frame_unpack(pixels + pixel_offsets[j] - pixel_offsets[first_image], &layout,
+                    buffer + offsets[j] - offsets[first_image]);
             }
-            int first_image = get_first_image_of_rank(rank, n_images, size);
-            int nb_pixels = offsets[first_image + nb_images_local] - offsets[first_image];
-            int* buffer = (int*)malloc(nb_pixels * sizeof(int));
-            MPI_Recv(buffer, nb_pixels, MPI_INT, root_process, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            process_images(buffer, nb_images_local, widths + first_image, heights + first_image, use_cuda, use_omp);
-            MPI_Send(buffer, nb_pixels, MPI_INT, root_process, 0, MPI_COMM_WORLD);
-            free(buffer);
+            ok = process_images(buffer, nb_images_local, widths + first_image, heights + first_image, radius,
+                use_cuda, use_omp, local_masks);
+            /* The masks go back even on failure, the root is waiting for them */
+            mpi_send_bytes(local_masks, nb_mask_bytes, root_process, 0);
         }
+        free(local_masks);
+        free(buffer);
+        free(pixels);
+        free(mask_offsets);
+        free(pixel_offsets);
         free(offsets);
+        if (rank != root_process) {
+            free(widths);
+            free(heights);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
     }
     if (rank != root_process) {
         free(image_information);
         MPI_Finalize();
-        return 0;
+        return !ok;
     }
-    flattened_matrix_to_gif(image, flattened_gif_matrix);
     free(flattened_gif_matrix);
+    if (!ok) {
+        fprintf(stderr, "Unable to filter the frames\n");
+        free(masks);
+        free(image_information);
+        MPI_Finalize();
+        return 1;
+    }
+    if (!edge_masks_to_gif(image, masks)) {
+        fprintf(stderr, "Unable to write the edges into the image\n");
+        free(masks);
+        free(image_information);
+        MPI_Finalize();
+        return 1;
+    }
+    free(masks);
     gettimeofday(&t2, NULL);
     duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
 
@@ -848,6 +2204,7 @@ int run(int argc, char** argv, int n_images, int width, int height, int N, char*
     }
     free(image_information);
     MPI_Finalize();
+    return 0;
 }
 
 /*
@@ -867,12 +2224,28 @@ int main(int argc, char** argv)
     int use_omp = 0;
     int use_cuda = 0;
     int has_file = 0;
+    int radius = 5;
 
     /* Check command-line arguments */
     if (argc < 3) {
-        fprintf(stderr, "%s input_filename, output_filename", argv[0]);
+        fprintf(stderr, "%s input_filename, output_filename [radius]", argv[0]);
         return 1;
     }
+
+    /* The blur radius can be given as an extra last argument in every mode */
+    if (argc == 4 || argc == 9 || argc == 11) {
+        char* end;
+        long value = strtol(argv[argc - 1], &end, 10);
+
+        /* Checked here so that a bad radius fails before MPI starts */
+        if (end == argv[argc - 1] || *end != '\0' || value < 0 || value > BLUR_KERNELS_MAX_SIZE) {
+            fprintf(stderr, "Invalid blur radius %s, expected 0 to %d\n", argv[argc - 1], BLUR_KERNELS_MAX_SIZE);
+            fprintf(stderr, "%s input_filename, output_filename [radius]\n", argv[0]);
+            return 1;
+        }
+        radius = (int)value;
+        argc--;
+    }
     if (argc == 3) {
         input_filename = argv[1];
         output_filename = argv[2];
@@ -903,6 +2276,5 @@ int main(int argc, char** argv)
         benchmark = 1;
         has_file = 1;
     }
-    run(argc, argv, benchmark_n_images, benchmark_width, benchmark_height, N, input_filename, output_filename, benchmark, has_file, use_mpi, use_omp, use_cuda);
-    return 0;
+    return run(argc, argv, benchmark_n_images, benchmark_width, benchmark_height, N, input_filename, output_filename, benchmark, has_file, radius, use_mpi, use_omp, use_cuda);
 }
@@ -0,0 +1,164 @@
+/*
+ * INF560
+ *
+ * Sobel inner loop: a scalar version and AVX2 / AVX-512 versions picked
+ * at run time. All of them compare the squared gradient in integers.
+ */
+#include <stddef.h>
+
+#include "frame_layout.h"
+#include "sobel_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOBEL_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+static inline int sobel_pixel(const unsigned char* above, const unsigned char* row,
+    const unsigned char* below, int k)
+{
+    int dx = -above[k - 1] + above[k + 1] - 2 * row[k - 1] + 2 * row[k + 1]
+        - below[k - 1] + below[k + 1];
+    int dy = below[k + 1] + 2 * below[k] + below[k - 1]
+        - above[k + 1] - 2 * above[k] - above[k - 1];
+
+    return dx * dx + dy * dy > SOBEL_THRESHOLD_SQ ? 255 : 0;
+}
+
+static void sobel_row_scalar(const unsigned char* above, const unsigned char* row,
+    const unsigned char* below, unsigned char* out, int width)
+{
+    int k;
+
+    for (k = 1; k < width - 1; k++) {
+        out[k] = sobel_pixel(above, row, below, k);
+    }
+}
+
+static const sobel_kernels kernels_scalar = {
+    "scalar",
+    sobel_row_scalar
+};
+
+#ifdef SOBEL_KERNELS_X86
+
+/*
+ * Pixels are widened to 16-bit lanes, where dx and dy (at most 4*255 in
+ * magnitude) fit. madd_epi16 on (dx, dy) pairs, unpacked per 128-bit
+ * lane, yields dx^2 + dy^2 in 32-bit lanes; packs_epi32 on the two halves
+ * puts the comparison results back in pixel order.
+ */
+#define SOBEL_GRADIENTS(vec, load, add, sub, slli)                     \
+    vec no = load(above + k - 1);                                       \
+    vec n = load(above + k);                                            \
+    vec ne = load(above + k + 1);                                       \
+    vec o = load(row + k - 1);                                          \
+    vec e = load(row + k + 1);                                          \
+    vec so = load(below + k - 1);                                       \
+    vec s = load(below + k);                                            \
+    vec se = load(below + k + 1);                                       \
+    vec dx = add(add(sub(ne, no), sub(se, so)), slli(sub(e, o), 1));    \
+    vec dy = add(add(sub(se, ne), sub(so, no)), slli(sub(s, n), 1))
+
+/* Columns the vector kernels computed in passing but must not change */
+static inline void sobel_keep_border(const unsigned char* row, unsigned char* out, int width)
+{
+    out[0] = row[0];
+    out[width - 1] = row[width - 1];
+}
+
+/* 16 pixels widened to 16 bits */
+__attribute__((target("avx2")))
+static inline __m256i load_avx2(const unsigned char* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+__attribute__((target("avx2")))
+static void sobel_row_avx2(const unsigned char* above, const unsigned char* row,
+    const unsigned char* below, unsigned char* out, int width)
+{
+    __m256i limit = _mm256_set1_epi32(SOBEL_THRESHOLD_SQ);
+    int k;
+
+    for (k = 0; k < width; k += 16) {
+        SOBEL_GRADIENTS(__m256i, load_avx2, _mm256_add_epi16, _mm256_sub_epi16,
+            _mm256_slli_epi16);
+        __m256i lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i hi = _mm256_unpackhi_epi16(dx, dy);
+        __m256i edges;
+
+        lo = _mm256_cmpgt_epi32(_mm256_madd_epi16(lo, lo), limit);
+        hi = _mm256_cmpgt_epi32(_mm256_madd_epi16(hi, hi), limit);
+        edges = _mm256_packs_epi32(lo, hi);
+        /* All ones is 255 once narrowed to bytes */
+        _mm_store_si128((__m128i*)(out + k), _mm_packs_epi16(_mm256_castsi256_si128(edges),
+            _mm256_extracti128_si256(edges, 1)));
+    }
+    sobel_keep_border(row, out, width);
+}
+
+static const sobel_kernels kernels_avx2 = {
+    "avx2",
+    sobel_row_avx2
+};
+
+/* 32 pixels widened to 16 bits */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load_avx512(const unsigned char* p)
+{
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void sobel_row_avx512(const unsigned char* above, const unsigned char* row,
+    const unsigned char* below, unsigned char* out, int width)
+{
+    __m512i limit = _mm512_set1_epi32(SOBEL_THRESHOLD_SQ);
+    __m512i ones = _mm512_set1_epi32(-1);
+    int k;
+
+    for (k = 0; k < width; k += 32) {
+        SOBEL_GRADIENTS(__m512i, load_avx512, _mm512_add_epi16, _mm512_sub_epi16,
+            _mm512_slli_epi16);
+        __m512i lo = _mm512_unpacklo_epi16(dx, dy);
+        __m512i hi = _mm512_unpackhi_epi16(dx, dy);
+
+        lo = _mm512_maskz_mov_epi32(_mm512_cmpgt_epi32_mask(_mm512_madd_epi16(lo, lo), limit),
+            ones);
+        hi = _mm512_maskz_mov_epi32(_mm512_cmpgt_epi32_mask(_mm512_madd_epi16(hi, hi), limit),
+            ones);
+        _mm256_store_si256((__m256i*)(out + k),
+            _mm512_cvtepi16_epi8(_mm512_packs_epi32(lo, hi)));
+    }
+    sobel_keep_border(row, out, width);
+}
+
+static const sobel_kernels kernels_avx512 = {
+    "avx512",
+    sobel_row_avx512
+};
+
+#endif /* SOBEL_KERNELS_X86 */
+
+const sobel_kernels* sobel_kernels_select(void)
+{
+    static const sobel_kernels* selected = NULL;
+
+    if (selected != NULL) {
+        return selected;
+    }
+
+    selected = &kernels_scalar;
+#ifdef SOBEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        selected = &kernels_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        selected = &kernels_avx2;
+    }
+#endif
+
+    return selected;
+}
@@ -0,0 +1,45 @@
+/*
+ * INF560
+ *
+ * Exhaustive check of blur_divisor_init: for every supported radius, the
+ * multiply-shift has to match t / n for every box sum t a frame can give.
+ */
+#include <stdio.h>
+
+#include "blur_kernels.h"
+
+int main(void)
+{
+    int size;
+    int failures = 0;
+
+    for (size = 0; size <= BLUR_KERNELS_MAX_SIZE; size++) {
+        blur_divisor div;
+        int n = (2 * size + 1) * (2 * size + 1);
+        long long max_sum = 255LL * n;
+        long long t;
+
+        if (!blur_divisor_init(&div, n, (int)max_sum)) {
+            fprintf(stderr, "Radius %d: no divisor for n = %d\n", size, n);
+            failures++;
+            continue;
+        }
+
+        for (t = 0; t <= max_sum; t++) {
+            if ((long long)(((unsigned long long)t * div.mul) >> div.shift) != t / n) {
+                fprintf(stderr, "Radius %d: %lld / %d gives %llu (mul %u, shift %d)\n",
+                        size, t, n, ((unsigned long long)t * div.mul) >> div.shift,
+                        div.mul, div.shift);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "blur_divisor_check: %d radii failed\n", failures);
+        return 1;
+    }
+    printf("blur_divisor_check: radii 0 to %d OK\n", BLUR_KERNELS_MAX_SIZE);
+    return 0;
+}